@@ -0,0 +1,88 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# binding.rb - measure the per-event cost of the binding                #
+#                                                                       #
+# Run this against the extension built with the fake libfam in          #
+# bench/fakefam (see "rake bench:binding"), so that the numbers are the #
+# binding's and not the daemon's.  Prints events/sec, Ruby objects      #
+# allocated per event and GC time for each way of reading events.       #
+#########################################################################
+
+require 'fam'
+
+EVENTS = Integer(ENV['EVENTS'] || 200_000)
+BATCH = Integer(ENV['BATCH'] || 256)
+
+def clock
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+# GC time in seconds (GC.stat(:time) is in milliseconds, Ruby 3.1+)
+def gc_time
+  if GC.stat.key?(:time)
+    GC.stat(:time) / 1000.0
+  else
+    GC::Profiler.total_time
+  end
+end
+
+#
+# Open a connection with the given options, wait for the initial
+# EXISTS/END_EXIST listing, and time the block, which reads events and
+# returns how many it read, until EVENTS events have been read.
+#
+def run(name, opts = {})
+  ENV['FAKEFAM_EVENTS'] = EVENTS.to_s
+  fam = Fam::Connection.new('bench', opts)
+  fam.monitor_file __FILE__
+
+  # skip the listing
+  loop { break if fam.next_event.code == Fam::Event::END_EXIST }
+
+  GC.start
+  GC::Profiler.enable unless GC.stat.key?(:time)
+  objs, gc, start = GC.stat(:total_allocated_objects), gc_time, clock
+
+  n = 0
+  n += yield(fam) while n < EVENTS
+
+  secs = clock - start
+  objs = GC.stat(:total_allocated_objects) - objs
+  gc = gc_time - gc
+
+  printf "%-24s %10.0f ev/s %8.2f obj/ev %8.3fs gc\n",
+         name, n / secs, objs.to_f / n, gc
+ensure
+  fam.close if fam
+end
+
+puts "#{EVENTS} events (#{RUBY_DESCRIPTION})"
+
+run('next_event') { |fam| fam.next_event; 1 }
+
+run('next_events') { |fam| fam.next_events(BATCH).size }
+
+run('drain + IO.select') do |fam|
+  @io ||= {}
+  io = (@io[fam] ||= IO.for_fd(fam.fd, :autoclose => false))
+  IO.select([io])
+  fam.drain(BATCH).size
+end
+
+run('each_event') do |fam|
+  n = 0
+  fam.each_event { |code, reqnum, file| break if (n += 1) >= EVENTS }
+  n
+end
+
+run('next_event + latency') do |fam|
+  fam.record_latency(fam.next_event)
+  1
+end
+
+run('next_event, :reader', :reader => true) { |fam| fam.next_event; 1 }
+
+run('next_events, :reader', :reader => true) do |fam|
+  fam.next_events(BATCH).size
+end
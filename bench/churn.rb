@@ -0,0 +1,111 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# churn.rb - end-to-end throughput and latency against a real backend   #
+#                                                                       #
+# A writer thread creates, modifies and deletes files in a scratch      #
+# directory (on tmpfs when /dev/shm is available, so the disk isn't     #
+# measured), while the main thread reads the resulting events.  Prints  #
+# operation and event throughput, and latency percentiles both from     #
+# the file operation to the event being handled, and from the event     #
+# being received (Fam::Event#received_at) to it being handled.          #
+#                                                                       #
+# Environment:                                                          #
+#   BACKEND  fam or inotify (default: the connection's default)         #
+#   OPS      file operations to perform (default 50000)                 #
+#   FILES    distinct files to cycle through (default 256)              #
+#   RATE     operations per second (default 0, as fast as possible)     #
+#   READER   reader thread ring size (default: no reader thread)        #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+OPS = Integer(ENV['OPS'] || 50_000)
+FILES = Integer(ENV['FILES'] || 256)
+RATE = Float(ENV['RATE'] || 0)
+
+def clock
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def pct(sorted, p)
+  sorted[[(sorted.size * p / 100.0).ceil - 1, 0].max]
+end
+
+opts = {}
+opts[:backend] = ENV['BACKEND'].to_sym if ENV['BACKEND']
+opts[:reader] = Integer(ENV['READER']) if ENV['READER']
+
+base = File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+dir = Dir.mktmpdir('fam-churn', base)
+
+begin
+  fam = Fam::Connection.new('churn', opts)
+  fam.monitor_directory dir
+
+  # skip the listing
+  loop { break if fam.next_event.code == Fam::Event::END_EXIST }
+
+  # time of the last operation on each file, written by the writer
+  # thread; the read side tolerates races, which only skew one sample
+  touched = {}
+  names = (0...FILES).map { |i| "file#{i}" }
+  done = false
+
+  writer = Thread.new do
+    start = clock
+    OPS.times do |i|
+      if RATE > 0
+        delay = start + i / RATE - clock
+        sleep delay if delay > 0
+      end
+
+      name = names[i % FILES]
+      path = File.join(dir, name)
+      touched[name] = clock
+      case (i / FILES) % 3
+      when 0 then File.open(path, 'w') { |f| f << i }   # create
+      when 1 then File.open(path, 'a') { |f| f << i }   # change
+      else        File.unlink(path)                     # delete
+      end
+    end
+    done = true
+  end
+
+  e2e = []
+  events = 0
+  start = clock
+
+  # read until the writer is done and the events have dried up
+  loop do
+    unless ev = fam.next_event(done ? 0.5 : 1.0)
+      break if done
+      next
+    end
+
+    if t = touched[ev.filename]
+      e2e << clock - t
+    end
+    fam.record_latency(ev)
+    events += 1
+  end
+
+  secs = clock - start - 0.5
+  writer.join
+  e2e.sort!
+
+  puts "backend: #{fam.backend}, reader: #{opts[:reader] || 'off'}, " <<
+       "dir: #{dir}"
+  printf "%d ops, %d events in %.2fs: %.0f ops/s, %.0f ev/s\n",
+         OPS, events, secs, OPS / secs, events / secs
+  [50, 90, 99, 99.9].each do |p|
+    printf "p%-5s op->handled %9.1fus   received->handled %9.1fus\n",
+           p, (pct(e2e, p) || 0) * 1e6, (fam.latency(p) || 0) * 1e6
+  end
+  printf "dropped: %d, overflows: %d\n", fam.dropped, fam.overflows
+ensure
+  fam.close if fam
+  FileUtils.rm_rf dir
+end
@@ -0,0 +1,435 @@
+/*
+ * fam.c - in-process stand-in for libfam, for benchmarking the binding.
+ *
+ * Instead of talking to a daemon, each connection starts a thread which
+ * synthesizes events for the monitored requests, round-robin, at a
+ * configurable rate.  Event data is generated on demand in
+ * FAMNextEvent, so the cost measured is (almost) all the binding's.
+ * The connection descriptor is one end of a socket pair which is kept
+ * readable while events are pending, so select()/poll() based waiting
+ * behaves like it does against the real daemon.
+ *
+ * Configuration is read from the environment when the connection is
+ * opened:
+ *
+ *   FAKEFAM_EVENTS  events to synthesize (default 0, unlimited)
+ *   FAKEFAM_RATE    events per second (default 0, as fast as possible)
+ *   FAKEFAM_FILES   distinct filenames to cycle through (default 64)
+ *   FAKEFAM_QUEUE   maximum undelivered events, like the daemon's
+ *                   socket buffer (default 16384)
+ *   FAKEFAM_CODES   comma-separated event codes to cycle through
+ *                   (default "1", FAMChanged)
+ *
+ * Monitors still generate the EXISTS/END_EXIST listing and cancels the
+ * ACKNOWLEDGE event, as with the real daemon.  Suspend, resume, and
+ * debug level calls are accepted and ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "fam.h"
+
+int FAMErrno = 0;
+const char *FamErrlist[] = {
+  "No error",
+  "Bad request",
+  "Out of memory",
+  "Connection closed",
+  NULL
+};
+
+#define MAX_CODES 16
+
+/* queued EXISTS/END_EXIST/ACKNOWLEDGE event */
+typedef struct Ctl {
+  struct Ctl *next;
+  int reqnum;
+  void *userdata;
+  int code;
+  char filename[1];
+} Ctl;
+
+typedef struct {
+  int reqnum;
+  void *userdata;
+} Req;
+
+typedef struct {
+  int wfd;                    /* write end of the socket pair */
+  pthread_t thread;
+  int stopping;               /* atomic */
+
+  /* configuration */
+  long limit;
+  double rate;
+  long files;
+  long queue;
+  int codes[MAX_CODES];
+  int num_codes;
+  int no_exists;
+
+  /* monitored requests; only touched by FAM calls, which the caller
+   * serializes, except num_reqs, which the thread reads */
+  Req *reqs;
+  int num_reqs;               /* atomic */
+  int cap;
+  int next_reqnum;
+
+  Ctl *ctl_head, *ctl_tail;
+
+  long produced;              /* atomic; synthesized so far */
+  long consumed;              /* synthesized events returned */
+} Client;
+
+static long env_long(const char *name, long def)
+{
+  const char *val = getenv(name);
+  return (val && *val) ? strtol(val, NULL, 10) : def;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void nap(long usec)
+{
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+/* make the descriptor readable; a full socket is readable already */
+static void poke(Client *c)
+{
+  char ch = 0;
+  if (send(c->wfd, &ch, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 &&
+      errno != EAGAIN && errno != EWOULDBLOCK)
+    FAMErrno = 3;
+}
+
+static void drain(int fd)
+{
+  char buf[256];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+static void *synth_main(void *ptr)
+{
+  Client *c = ptr;
+  double start = 0;
+  long total = 0;
+
+  while (!__atomic_load_n(&(c->stopping), __ATOMIC_ACQUIRE)) {
+    long backlog, n;
+
+    /* nothing to generate events for yet */
+    if (!__atomic_load_n(&(c->num_reqs), __ATOMIC_ACQUIRE)) {
+      nap(1000);
+      continue;
+    }
+    if (!start)
+      start = now();
+
+    backlog = __atomic_load_n(&(c->produced), __ATOMIC_ACQUIRE) -
+              __atomic_load_n(&(c->consumed), __ATOMIC_ACQUIRE);
+    n = c->queue - backlog;
+    if (c->rate > 0) {
+      long due = (long) ((now() - start) * c->rate) - total;
+      if (due < n)
+        n = due;
+    }
+    if (c->limit > 0 && c->limit - total < n)
+      n = c->limit - total;
+
+    if (n > 0) {
+      total += n;
+      __atomic_add_fetch(&(c->produced), n, __ATOMIC_RELEASE);
+      poke(c);
+    }
+
+    if (c->limit > 0 && total >= c->limit)
+      break;
+    nap((c->rate > 0) ? 1000 : 50);
+  }
+
+  return NULL;
+}
+
+static void ctl_push(Client *c, int reqnum, void *userdata, int code,
+                     const char *filename)
+{
+  size_t len = strlen(filename);
+  Ctl *e = malloc(sizeof(Ctl) + len);
+
+  if (!e) {
+    FAMErrno = 2;
+    return;
+  }
+  e->next = NULL;
+  e->reqnum = reqnum;
+  e->userdata = userdata;
+  e->code = code;
+  memcpy(e->filename, filename, len + 1);
+
+  if (c->ctl_tail)
+    c->ctl_tail->next = e;
+  else
+    c->ctl_head = e;
+  c->ctl_tail = e;
+  poke(c);
+}
+
+int FAMOpen(FAMConnection *fc)
+{
+  return FAMOpen2(fc, NULL);
+}
+
+int FAMOpen2(FAMConnection *fc, const char *appName)
+{
+  const char *codes = getenv("FAKEFAM_CODES");
+  int fds[2];
+  Client *c;
+
+  (void) appName;
+  if (!(c = calloc(1, sizeof(Client)))) {
+    FAMErrno = 2;
+    return -1;
+  }
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    free(c);
+    FAMErrno = 3;
+    return -1;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+  c->wfd = fds[1];
+  c->limit = env_long("FAKEFAM_EVENTS", 0);
+  c->rate = env_long("FAKEFAM_RATE", 0);
+  c->files = env_long("FAKEFAM_FILES", 64);
+  c->queue = env_long("FAKEFAM_QUEUE", 16384);
+  c->next_reqnum = 1;
+  if (c->files < 1)
+    c->files = 1;
+  if (c->queue < 1)
+    c->queue = 1;
+
+  while (codes && *codes && c->num_codes < MAX_CODES) {
+    char *end;
+    long code = strtol(codes, &end, 10);
+    if (end == codes)
+      break;
+    if (code >= FAMChanged && code <= FAMEndExist)
+      c->codes[c->num_codes++] = (int) code;
+    codes = (*end == ',') ? end + 1 : end;
+  }
+  if (!c->num_codes)
+    c->codes[c->num_codes++] = FAMChanged;
+
+  if (pthread_create(&(c->thread), NULL, synth_main, c)) {
+    close(fds[0]);
+    close(fds[1]);
+    free(c);
+    FAMErrno = 2;
+    return -1;
+  }
+
+  fc->fd = fds[0];
+  fc->client = c;
+  return 0;
+}
+
+int FAMClose(FAMConnection *fc)
+{
+  Client *c = fc->client;
+
+  if (!c)
+    return 0;
+
+  __atomic_store_n(&(c->stopping), 1, __ATOMIC_RELEASE);
+  pthread_join(c->thread, NULL);
+
+  close(fc->fd);
+  close(c->wfd);
+  while (c->ctl_head) {
+    Ctl *next = c->ctl_head->next;
+    free(c->ctl_head);
+    c->ctl_head = next;
+  }
+  free(c->reqs);
+  free(c);
+  fc->client = NULL;
+
+  return 0;
+}
+
+static int monitor(FAMConnection *fc, const char *filename, FAMRequest *fr,
+                   void *userData, int is_dir)
+{
+  Client *c = fc->client;
+  int n = c->num_reqs;
+
+  if (n == c->cap) {
+    int cap = c->cap ? c->cap * 2 : 16;
+    Req *reqs = realloc(c->reqs, cap * sizeof(Req));
+    if (!reqs) {
+      FAMErrno = 2;
+      return -1;
+    }
+    c->reqs = reqs;
+    c->cap = cap;
+  }
+
+  fr->reqnum = c->next_reqnum++;
+  c->reqs[n].reqnum = fr->reqnum;
+  c->reqs[n].userdata = userData;
+
+  if (!c->no_exists) {
+    ctl_push(c, fr->reqnum, userData, FAMExists, filename);
+    if (is_dir) {
+      DIR *dir = opendir(filename);
+      struct dirent *de;
+
+      while (dir && (de = readdir(dir)))
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+          ctl_push(c, fr->reqnum, userData, FAMExists, de->d_name);
+      if (dir)
+        closedir(dir);
+    }
+    ctl_push(c, fr->reqnum, userData, FAMEndExist, filename);
+  }
+
+  __atomic_store_n(&(c->num_reqs), n + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int FAMMonitorFile(FAMConnection *fc, const char *filename, FAMRequest *fr,
+                   void *userData)
+{
+  return monitor(fc, filename, fr, userData, 0);
+}
+
+int FAMMonitorDirectory(FAMConnection *fc, const char *filename,
+                        FAMRequest *fr, void *userData)
+{
+  return monitor(fc, filename, fr, userData, 1);
+}
+
+int FAMMonitorCollection(FAMConnection *fc, const char *filename,
+                         FAMRequest *fr, void *userData, int depth,
+                         const char *mask)
+{
+  (void) depth;
+  (void) mask;
+  return monitor(fc, filename, fr, userData, 1);
+}
+
+int FAMSuspendMonitor(FAMConnection *fc, const FAMRequest *fr)
+{
+  (void) fc;
+  (void) fr;
+  return 0;
+}
+
+int FAMResumeMonitor(FAMConnection *fc, const FAMRequest *fr)
+{
+  (void) fc;
+  (void) fr;
+  return 0;
+}
+
+int FAMCancelMonitor(FAMConnection *fc, const FAMRequest *fr)
+{
+  Client *c = fc->client;
+  int i;
+
+  for (i = 0; i < c->num_reqs; i++) {
+    if (c->reqs[i].reqnum == fr->reqnum) {
+      ctl_push(c, fr->reqnum, c->reqs[i].userdata, FAMAcknowledge, "");
+      c->reqs[i] = c->reqs[c->num_reqs - 1];
+      __atomic_store_n(&(c->num_reqs), c->num_reqs - 1, __ATOMIC_RELEASE);
+      return 0;
+    }
+  }
+
+  FAMErrno = 1;
+  return -1;
+}
+
+int FAMPending(FAMConnection *fc)
+{
+  Client *c = fc->client;
+
+  if (c->ctl_head)
+    return 1;
+  return (__atomic_load_n(&(c->produced), __ATOMIC_ACQUIRE) > c->consumed &&
+          c->num_reqs > 0);
+}
+
+int FAMNextEvent(FAMConnection *fc, FAMEvent *fe)
+{
+  Client *c = fc->client;
+
+  fe->fc = fc;
+  fe->hostname = NULL;
+
+  if (c->ctl_head) {
+    Ctl *e = c->ctl_head;
+
+    if (!(c->ctl_head = e->next))
+      c->ctl_tail = NULL;
+    fe->fr.reqnum = e->reqnum;
+    fe->userdata = e->userdata;
+    fe->code = e->code;
+    strcpy(fe->filename, e->filename);
+    free(e);
+  } else if (FAMPending(fc)) {
+    long seq = c->consumed;
+    Req *req = c->reqs + seq % c->num_reqs;
+
+    fe->fr.reqnum = req->reqnum;
+    fe->userdata = req->userdata;
+    fe->code = c->codes[seq % c->num_codes];
+    snprintf(fe->filename, sizeof(fe->filename), "file%ld",
+             seq % c->files);
+    __atomic_store_n(&(c->consumed), seq + 1, __ATOMIC_RELEASE);
+  } else {
+    FAMErrno = 1;
+    return -1;
+  }
+
+  /* caught up: clear the descriptor, unless something arrived since */
+  if (!FAMPending(fc)) {
+    drain(fc->fd);
+    if (FAMPending(fc))
+      poke(c);
+  }
+
+  return 1;
+}
+
+int FAMDebugLevel(FAMConnection *fc, int level)
+{
+  (void) fc;
+  (void) level;
+  return 1;
+}
+
+int FAMNoExists(FAMConnection *fc)
+{
+  ((Client*) fc->client)->no_exists = 1;
+  return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * fam.h - interface of the benchmark stand-in for libfam.
+ *
+ * The types and prototypes match FAM 2.7's fam.h, so the extension
+ * builds against this header unchanged.  See fam.c for how events are
+ * generated.
+ */
+#ifndef FAKEFAM_H
+#define FAKEFAM_H
+
+#include <limits.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FAMConnection {
+  int fd;
+  void *client;
+} FAMConnection;
+
+#define FAMCONNECTION_GETFD(fc) ((fc)->fd)
+
+typedef struct FAMRequest {
+  int reqnum;
+} FAMRequest;
+
+#define FAMREQUEST_GETREQNUM(fr) ((fr)->reqnum)
+
+enum FAMCodes {
+  FAMChanged = 1,
+  FAMDeleted = 2,
+  FAMStartExecuting = 3,
+  FAMStopExecuting = 4,
+  FAMCreated = 5,
+  FAMMoved = 6,
+  FAMAcknowledge = 7,
+  FAMExists = 8,
+  FAMEndExist = 9
+};
+
+typedef struct FAMEvent {
+  FAMConnection *fc;
+  FAMRequest fr;
+  char *hostname;
+  char filename[PATH_MAX];
+  void *userdata;
+  enum FAMCodes code;
+} FAMEvent;
+
+extern int FAMErrno;
+extern const char *FamErrlist[];
+
+int FAMOpen(FAMConnection *fc);
+int FAMOpen2(FAMConnection *fc, const char *appName);
+int FAMClose(FAMConnection *fc);
+int FAMMonitorFile(FAMConnection *fc, const char *filename,
+                   FAMRequest *fr, void *userData);
+int FAMMonitorDirectory(FAMConnection *fc, const char *filename,
+                        FAMRequest *fr, void *userData);
+int FAMMonitorCollection(FAMConnection *fc, const char *filename,
+                         FAMRequest *fr, void *userData, int depth,
+                         const char *mask);
+int FAMSuspendMonitor(FAMConnection *fc, const FAMRequest *fr);
+int FAMResumeMonitor(FAMConnection *fc, const FAMRequest *fr);
+int FAMCancelMonitor(FAMConnection *fc, const FAMRequest *fr);
+int FAMNextEvent(FAMConnection *fc, FAMEvent *fe);
+int FAMPending(FAMConnection *fc);
+int FAMDebugLevel(FAMConnection *fc, int level);
+int FAMNoExists(FAMConnection *fc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FAKEFAM_H */
@@ -18,12 +18,10 @@ unless test ?d, path
   exit 1
 end
 
-# open a connection to FAM and start monitoring specified path
+# open a connection to FAM and start monitoring specified path; the
+# extension keeps the list of files up to date as events are read
 fam = Fam::Connection.new $0
-fam.monitor_dir path
-
-# get a list of files in the directory
-files = Dir["#{path}/*"].collect! { |f| File::basename f }
+files = fam.monitor_dir(path, :state => true).state
 
 # method to print out command prompt
 def prompt
@@ -42,19 +40,15 @@ while Time.now < start_time + 120
   if fam.pending?
     ev = fam.next_event
     case ev.code
-      when Fam::Event::EXISTS
-        files << ev.file unless ev.file == path
       when Fam::Event::CHANGED
         puts 'File changed: ' << ev.file
         prompt
       when Fam::Event::DELETED
         puts 'File deleted: ' << ev.file
         prompt
-        files -= [ev.file]
       when Fam::Event::CREATED
         puts 'File created: ' << ev.file
         prompt
-        files << ev.file
     end
 
   end
@@ -63,7 +57,7 @@ while Time.now < start_time + 120
   if select([$stdin], nil, nil, 0.1)
     case cmd = $stdin.gets
       when /^\s*ls/i
-        puts 'File list: ' << files.join(', ')
+        puts 'File list: ' << files.sort.join(', ')
       when /^\s*quit/i
         exit 0
       when /^\s*q/i
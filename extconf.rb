@@ -5,11 +5,33 @@ require 'mkmf'
 
 if have_library('fam', 'FAMOpen')
   have_func('rb_define_alloc_func', 'ruby.h')
+  have_func('rb_ext_ractor_safe', 'ruby.h')
+  have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+  if have_header('ruby/ractor.h')
+    have_func('rb_ractor_local_storage_value_newkey', 'ruby/ractor.h')
+  end
+  have_header('ruby/io.h')
+  have_func('rb_stat_new', ['ruby.h', 'ruby/io.h'])
+  if have_header('ruby/fiber/scheduler.h')
+    have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+  end
+  have_header('pthread.h')
+  have_header('sys/sdt.h')
+  have_struct_member('struct stat', 'st_mtim', 'sys/stat.h')
   have_func('FAMDebugLevel', 'fam.h')
   have_func('FAMSuspendMonitor', 'fam.h')
   have_func('FAMResumeMonitor', 'fam.h')
   have_func('FAMMonitorCollection', 'fam.h')
   have_func('FAMNoExists', 'fam.h')
+
+  # native inotify backend (Linux)
+  if have_header('sys/inotify.h')
+    have_func('inotify_init1', 'sys/inotify.h')
+    have_func('eventfd', 'sys/eventfd.h')
+    have_func('epoll_create1', 'sys/epoll.h')
+  end
+
   $LDFLAGS << ' -lfam'
   create_makefile("fam")
 end
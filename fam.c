@@ -24,9 +24,62 @@
 /* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.               */
 /************************************************************************/
 
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#define USE_READER
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#endif
 #include <ruby.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_IO_H
+#include <ruby/io.h>
+#endif
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include <ruby/fiber/scheduler.h>
+#endif
+#ifdef HAVE_RUBY_RACTOR_H
+#include <ruby/ractor.h>
+#endif
 #include <fam.h>
 
+/*
+ * Static (USDT) probes, for tracing with bpftrace, perf, or SystemTap.
+ * A probe that isn't attached is a single nop in the instruction
+ * stream, so they are always compiled in when sys/sdt.h is available.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define FAM_PROBE2(name, a, b) DTRACE_PROBE2(fam, name, a, b)
+#define FAM_PROBE3(name, a, b, c) DTRACE_PROBE3(fam, name, a, b, c)
+#define FAM_PROBE4(name, a, b, c, d) DTRACE_PROBE4(fam, name, a, b, c, d)
+#else
+#define FAM_PROBE2(name, a, b) do { } while (0)
+#define FAM_PROBE3(name, a, b, c) do { } while (0)
+#define FAM_PROBE4(name, a, b, c, d) do { } while (0)
+#endif /* HAVE_SYS_SDT_H */
+
 /* fam.h in gamin doesn't have these */
 #ifndef FAM_DEBUG_OFF
 #define FAM_DEBUG_OFF 0
@@ -34,14 +87,48 @@
 #define FAM_DEBUG_VERBOSE 2
 #endif
 
+/* lets Ractor.make_shareable share frozen objects with no mutable state */
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+#define FAM_TYPED_SHAREABLE RUBY_TYPED_FROZEN_SHAREABLE
+#else
+#define FAM_TYPED_SHAREABLE 0
+#endif
+
+/* pseudo-event code for lost events; not part of the FAM protocol */
+#define FAMOverflow 10
+
 #define VERSION "0.2.0"
 #define UNUSED(x) ((void) (x))
 
+/*
+ * Return the current time, in seconds, from a clock that isn't affected
+ * by changes to the system time (if available).
+ */
+static double fam_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+}
+
 static VALUE mFam;
 static VALUE mDebug;
 static VALUE cConn;
 static VALUE cReq;
 static VALUE cEvent;
+static VALUE cDirState;
+#if defined(USE_READER) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+static VALUE cDispatcher;
+static VALUE cDispWorker;
+#endif
 static VALUE eError;
 
 static const char *
@@ -52,12 +139,411 @@ fam_error(void)
   return "Unknown error";
 }
 
+/**********************/
+/* LATENCY HISTOGRAMS */
+/**********************/
+
+/*
+ * Event handling latencies are recorded in microseconds into log-linear
+ * buckets: values below 16 get a bucket each, and every power of two
+ * above that is split into 16 buckets, so a reported percentile is
+ * within 1/16 (6.25%) of the recorded value.  Recording never
+ * allocates once the histogram exists.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_MAG  40 /* about 12 days */
+#define HIST_BUCKETS  ((HIST_MAX_MAG - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct Hist {
+  unsigned long long counts[HIST_BUCKETS];
+  unsigned long long total;
+  unsigned long long max;   /* largest recorded value */
+} Hist;
+
+static int hist_index(unsigned long long v)
+{
+  int mag = 0;
+
+  if (v < HIST_SUB)
+    return (int) v;
+  if (v >> HIST_MAX_MAG)
+    return HIST_BUCKETS - 1;
+
+  while (v >> (mag + 1))
+    mag++;
+  return (mag - HIST_SUB_BITS + 1) * HIST_SUB +
+         (int) ((v >> (mag - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* largest value that falls in bucket i */
+static unsigned long long hist_value(int i)
+{
+  int shift;
+
+  if (i < HIST_SUB)
+    return i;
+  shift = i / HIST_SUB - 1;
+  return ((unsigned long long) (HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Record the latency of an event received at the given time.
+ */
+static void hist_record(Hist **hist, double received, double now)
+{
+  Hist *h = *hist;
+  double us = (now - received) * 1e6;
+  unsigned long long v = (us > 0) ? (unsigned long long) us : 0;
+
+  if (!h && !(h = *hist = calloc(1, sizeof(Hist))))
+    rb_raise(rb_eNoMemError, "Couldn't allocate latency histogram");
+
+  h->counts[hist_index(v)]++;
+  h->total++;
+  if (v > h->max)
+    h->max = v;
+}
+
+/*
+ * Return the pct percentile of a histogram, in seconds, or nil if
+ * nothing has been recorded.
+ */
+static VALUE hist_percentile(const Hist *h, VALUE pct)
+{
+  double p = NUM2DBL(pct);
+  unsigned long long want, seen = 0;
+  int i;
+
+  if (isnan(p) || !(p >= 0 && p <= 100))
+    rb_raise(rb_eArgError, "invalid percentile (not between 0 and 100)");
+  if (!h || !h->total)
+    return Qnil;
+
+  want = (unsigned long long) (p / 100 * h->total + 0.5);
+  if (want < 1)
+    want = 1;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    if ((seen += h->counts[i]) >= want) {
+      unsigned long long v = hist_value(i);
+      return rb_float_new(((v < h->max) ? v : h->max) / 1e6);
+    }
+  }
+
+  return rb_float_new(h->max / 1e6);
+}
+
 /*******************/
 /* REQUEST METHODS */
 /*******************/
-static VALUE wrap_req(FAMRequest *req)
+
+enum {
+  REQ_MONITOR,
+  REQ_TREE,
+  REQ_TREE_NODE
+};
+
+/* common header of everything passed to the backend as user data */
+typedef struct {
+  int type;
+} ReqHead;
+
+/*
+ * A monitor request.  The record is passed to the backend as the
+ * monitor's user data, so events map back to their Fam::Request (and
+ * its context) with a pointer dereference.  It stays on its
+ * connection's request list, which keeps the Fam::Request object
+ * alive, until the cancellation is acknowledged.
+ */
+typedef struct FamReq {
+  ReqHead head;
+  FAMRequest req;
+  VALUE self;                   /* the Fam::Request object */
+  VALUE context;
+  struct FamConn *conn;         /* NULL once off the request list */
+  struct FamReq *prev, *next;   /* request list */
+  struct Tree *tree;            /* for tree monitors */
+  struct FamFilter *filter;     /* event filter, or NULL */
+  VALUE snapshot;               /* initial listing, for snapshot monitors */
+  int skip_exists;              /* drop EXISTS/END_EXIST events */
+  Hist *latency;                /* handling latencies, or NULL */
+  VALUE state;                  /* Fam::DirState, or nil */
+  struct FpCache *fp;           /* fingerprints, or NULL */
+  char *path;                   /* directory (or tree root), or NULL */
+  int cancelled;                /* cancel_monitor was called */
+} FamReq;
+
+static void conn_forget_req(struct FamConn *conn, FamReq *rec);
+static void tree_detach(struct Tree *tree);
+static void filter_free(struct FamFilter *filter);
+static void fp_free(struct FpCache *fp);
+static size_t fp_memsize(const struct FpCache *fp);
+
+static void fam_req_mark(void *ptr)
+{
+  FamReq *rec = ptr;
+  rb_gc_mark(rec->context);
+  rb_gc_mark(rec->snapshot);
+  rb_gc_mark(rec->state);
+}
+
+static void fam_req_free(void *ptr)
+{
+  FamReq *rec = ptr;
+
+  if (rec->conn)
+    conn_forget_req(rec->conn, rec);
+  if (rec->tree)
+    tree_detach(rec->tree);
+  if (rec->filter)
+    filter_free(rec->filter);
+  free(rec->latency);
+  if (rec->fp)
+    fp_free(rec->fp);
+  if (rec->path)
+    xfree(rec->path);
+
+  xfree(rec);
+}
+
+static size_t fam_req_memsize(const void *ptr)
+{
+  const FamReq *rec = ptr;
+  return sizeof(FamReq) + (rec->latency ? sizeof(Hist) : 0) +
+         (rec->fp ? fp_memsize(rec->fp) : 0) +
+         (rec->path ? strlen(rec->path) + 1 : 0);
+}
+
+static const rb_data_type_t fam_req_type = {
+  "Fam::Request",
+  { fam_req_mark, fam_req_free, fam_req_memsize, },
+};
+
+/*
+ * Get the request record wrapped by a Fam::Request object.
+ */
+static FamReq *get_req(VALUE self)
+{
+  FamReq *rec;
+
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return rec;
+}
+
+/*
+ * Initialize a zeroed request record and create its Fam::Request
+ * object.
+ */
+static VALUE wrap_req(FamReq *rec, int type, VALUE context)
+{
+  rec->head.type = type;
+  rec->context = context;
+  rec->snapshot = Qnil;
+  rec->state = Qnil;
+  return rec->self = TypedData_Wrap_Struct(cReq, &fam_req_type, rec);
+}
+
+/*
+ * Create a request record and its Fam::Request object.
+ */
+static VALUE new_req(int type, VALUE context, FamReq **ret)
+{
+  FamReq *rec = ALLOC(FamReq);
+
+  memset(rec, 0, sizeof(FamReq));
+  *ret = rec;
+  return wrap_req(rec, type, context);
+}
+
+/*
+ * Remember the directory a request's event filenames are relative to.
+ */
+static void req_set_path(FamReq *rec, const char *path)
+{
+  size_t len = strlen(path) + 1;
+
+  rec->path = ALLOC_N(char, len);
+  memcpy(rec->path, path, len);
+}
+
+/*
+ * Get the optional :context value from a monitor options hash.
+ */
+static VALUE get_context(VALUE opts)
+{
+  if (NIL_P(opts))
+    return Qnil;
+
+  Check_Type(opts, T_HASH);
+  return rb_hash_aref(opts, ID2SYM(rb_intern("context")));
+}
+
+/*
+ * Per-request event filter, compiled from the :codes, :include and
+ * :exclude monitor options.  Events are checked right after they are
+ * read, so filtered events never become Ruby objects.  Allocated with
+ * malloc, like the rest of the backend state.
+ */
+typedef struct FamFilter {
+  int refs;                     /* requests sharing this filter */
+  unsigned int codes;           /* bit mask of event codes, 0 = all */
+  char **pats;                  /* include patterns, then exclude patterns */
+  int num_include, num_exclude;
+} FamFilter;
+
+static void filter_free(FamFilter *filter)
+{
+  int i;
+
+  if (--filter->refs > 0)
+    return;
+
+  for (i = 0; i < filter->num_include + filter->num_exclude; i++)
+    free(filter->pats[i]);
+  free(filter->pats);
+  free(filter);
+}
+
+/*
+ * Convert a filter option (nil, a value, or an array of values) to an
+ * array.
+ */
+static VALUE filter_list(VALUE opts, const char *key)
+{
+  VALUE val = rb_hash_aref(opts, ID2SYM(rb_intern(key)));
+
+  if (NIL_P(val))
+    return rb_ary_new();
+  if (TYPE(val) == T_ARRAY)
+    return rb_ary_dup(val);
+  return rb_ary_new3(1, val);
+}
+
+/*
+ * Compile the filter options in a monitor options hash, plus an extra
+ * include pattern (if given).  Returns NULL if there is nothing to
+ * filter.
+ */
+static FamFilter *get_filter(VALUE opts, const char *extra)
+{
+  VALUE codes, pats, val;
+  FamFilter *ret;
+  long i, num_include;
+  unsigned int mask = 0;
+  int code;
+
+  if (NIL_P(opts)) {
+    codes = pats = rb_ary_new();
+  } else {
+    Check_Type(opts, T_HASH);
+    codes = filter_list(opts, "codes");
+    pats = filter_list(opts, "include");
+  }
+
+  if (extra)
+    rb_ary_push(pats, rb_str_new2(extra));
+  num_include = RARRAY_LEN(pats);
+  if (!NIL_P(opts))
+    rb_ary_concat(pats, filter_list(opts, "exclude"));
+
+  for (i = 0; i < RARRAY_LEN(codes); i++) {
+    code = NUM2INT(rb_ary_entry(codes, i));
+    if (code < FAMChanged || code > FAMOverflow)
+      rb_raise(rb_eArgError, "invalid event code: %d", code);
+    mask |= 1U << code;
+  }
+
+  /* validate everything before allocating anything */
+  for (i = 0; i < RARRAY_LEN(pats); i++) {
+    val = rb_ary_entry(pats, i);
+    StringValueCStr(val);
+    rb_ary_store(pats, i, val);
+  }
+
+  if (!mask && !RARRAY_LEN(pats))
+    return NULL;
+
+  if (!(ret = calloc(1, sizeof(FamFilter))) ||
+      (RARRAY_LEN(pats) && !(ret->pats = calloc(RARRAY_LEN(pats), sizeof(char*))))) {
+    free(ret);
+    rb_memerror();
+  }
+
+  ret->refs = 1;
+  ret->codes = mask;
+  for (i = 0; i < RARRAY_LEN(pats); i++) {
+    if (!(ret->pats[i] = strdup(RSTRING_PTR(rb_ary_entry(pats, i))))) {
+      filter_free(ret);
+      rb_memerror();
+    }
+
+    if (i < num_include)
+      ret->num_include++;
+    else
+      ret->num_exclude++;
+  }
+
+  return ret;
+}
+
+/*
+ * Match a filename against a filter pattern.  Patterns without a slash
+ * match the last component of the filename; patterns with one match
+ * the whole filename, a component at a time, as shell globs do.
+ */
+static int filter_glob(const char *pat, const char *filename)
+{
+  const char *name;
+
+  if (strchr(pat, '/'))
+    return !fnmatch(pat, filename, FNM_PATHNAME | FNM_PERIOD);
+
+  if ((name = strrchr(filename, '/')) && name[1])
+    filename = name + 1;
+
+  return !fnmatch(pat, filename, FNM_PERIOD);
+}
+
+/*
+ * Do the filter's patterns let events for filename through?
+ */
+static int filter_match_name(const FamFilter *filter, const char *filename)
+{
+  int i, found;
+
+  if (filter->num_include) {
+    for (i = found = 0; !found && i < filter->num_include; i++)
+      found = filter_glob(filter->pats[i], filename);
+    if (!found)
+      return 0;
+  }
+
+  for (i = 0; i < filter->num_exclude; i++)
+    if (filter_glob(filter->pats[filter->num_include + i], filename))
+      return 0;
+
+  return 1;
+}
+
+/*
+ * Should the given event be delivered?  Filename patterns only apply
+ * to events which name a file (not ACKNOWLEDGE or ENDEXIST), and
+ * OVERFLOW events are always delivered.
+ */
+static int filter_match(const FamFilter *filter, const FAMEvent *ev)
 {
-  return Data_Wrap_Struct(cReq, 0, 0, req);
+  /* lost events are everyone's business */
+  if (ev->code == FAMOverflow)
+    return 1;
+
+  if (filter->codes && !(filter->codes & (1U << ev->code)))
+    return 0;
+
+  if (ev->code == FAMAcknowledge || ev->code == FAMEndExist)
+    return 1;
+
+  return filter_match_name(filter, ev->filename);
 }
 
 /*
@@ -74,18 +560,231 @@ static VALUE wrap_req(FAMRequest *req)
  */
 static VALUE fam_req_num(VALUE self)
 {
-  FAMRequest *req;
+  FamReq *rec;
+
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return INT2NUM(FAMREQUEST_GETREQNUM(&(rec->req)));
+}
+
+/*
+ * Return the context object of a Fam::Request object (the :context
+ * option passed to the monitor method), or nil.
+ *
+ * Examples:
+ *   handler = req.context
+ *
+ */
+static VALUE fam_req_context(VALUE self)
+{
+  FamReq *rec;
+
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return rec->context;
+}
+
+/*
+ * Return the initial listing of a directory monitored with the
+ * :snapshot option (see Fam::Connection#monitor_directory), or nil.
+ *
+ * Examples:
+ *   req = fam.monitor_directory '/tmp', :snapshot => true
+ *   req.snapshot.each { |name| puts 'exists: ' << name }
+ *
+ */
+static VALUE fam_req_snapshot(VALUE self)
+{
+  FamReq *rec;
+
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return rec->snapshot;
+}
+
+/*
+ * Return the Fam::DirState object of a directory monitored with the
+ * :state option (see Fam::Connection#monitor_directory), or nil.
+ *
+ * Examples:
+ *   req = fam.monitor_directory '/var/spool', :state => true
+ *   fam.drain
+ *   req.state.each { |name| puts name }
+ *
+ */
+static VALUE fam_req_state(VALUE self)
+{
+  FamReq *rec;
+
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return rec->state;
+}
+
+/*
+ * Returns true if the monitor request is still on its connection: it
+ * hasn't been cancelled, or the daemon hasn't acknowledged the
+ * cancellation yet, and the connection is open.
+ *
+ * Examples:
+ *   fam.cancel req
+ *   fam.next_event while req.active?
+ *
+ */
+static VALUE fam_req_active(VALUE self)
+{
+  FamReq *rec;
+
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return rec->conn ? Qtrue : Qfalse;
+}
+
+/*
+ * Returns true if the monitor request has been cancelled with
+ * Fam::Connection#cancel_monitor.
+ *
+ * Examples:
+ *   fam.cancel req unless req.cancelled?
+ *
+ */
+static VALUE fam_req_cancelled(VALUE self)
+{
+  FamReq *rec;
+
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return rec->cancelled ? Qtrue : Qfalse;
+}
+
+/*
+ * Return the pct percentile (0 to 100) of the handling latencies
+ * recorded for events from this monitor with
+ * Fam::Connection#record_latency, in seconds, or nil if none have been
+ * recorded.
+ *
+ * Raises an ArgumentError exception if pct is out of range.
+ *
+ * Examples:
+ *   puts "p99: #{req.latency(99)}s"
+ *
+ */
+static VALUE fam_req_latency(VALUE self, VALUE pct)
+{
+  FamReq *rec;
 
-  Data_Get_Struct(self, FAMRequest, req);
-  return INT2NUM(FAMREQUEST_GETREQNUM(req));
+  TypedData_Get_Struct(self, FamReq, &fam_req_type, rec);
+  return hist_percentile(rec->latency, pct);
 }
 
 /*****************/
 /* EVENT METHODS */
 /*****************/
-static VALUE wrap_ev(FAMEvent *ev)
+
+/* event flags */
+#define EV_METADATA_ONLY 1  /* CHANGED, but the content hash didn't */
+#define EV_MOVED 2          /* MOVED; the old filename follows the new one */
+
+/*
+ * What the extension knows about an event beyond the FAMEvent itself.
+ * It travels with the event through the coalescing queue.
+ */
+typedef struct {
+  double received;  /* monotonic receive time */
+  int flags;
+  VALUE from;       /* Fam::Request of the old filename, for EV_MOVED */
+} EvMeta;
+
+/*
+ * Compact copy of a FAMEvent.  FAMEvent embeds a PATH_MAX filename
+ * buffer, so instead of keeping the whole structure alive for every
+ * Fam::Event we copy out the fields we need and size the filename to
+ * fit.
+ */
+typedef struct {
+  int code;
+  int reqnum;
+  VALUE request;    /* Fam::Request object, or nil */
+  char *hostname;   /* NULL unless the event came from a remote host */
+  EvMeta meta;
+  long len;
+  char filename[1];
+} FamEv;
+
+static void fam_ev_mark(void *ptr)
+{
+  FamEv *ev = ptr;
+  rb_gc_mark(ev->request);
+  rb_gc_mark(ev->meta.from);
+}
+
+static void fam_ev_free(void *ptr)
+{
+  FamEv *ev = ptr;
+
+  if (ev->hostname)
+    xfree(ev->hostname);
+  xfree(ev);
+}
+
+static size_t fam_ev_memsize(const void *ptr)
+{
+  const FamEv *ev = ptr;
+  size_t ret = offsetof(FamEv, filename) + ev->len + 1;
+
+  if (ev->meta.flags & EV_MOVED)
+    ret += strlen(ev->filename + ev->len + 1) + 1;
+  if (ev->hostname)
+    ret += strlen(ev->hostname) + 1;
+  return ret;
+}
+
+static const rb_data_type_t fam_ev_type = {
+  "Fam::Event",
+  { fam_ev_mark, fam_ev_free, fam_ev_memsize, },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | FAM_TYPED_SHAREABLE,
+#endif
+};
+
+/*
+ * Create a Fam::Event object.  filename is followed by the old filename
+ * if meta has EV_MOVED set.
+ */
+static VALUE new_ev(int code, int reqnum, VALUE request, const char *hostname,
+                    const char *filename, const EvMeta *meta)
+{
+  long len = strlen(filename), size = len + 1;
+  FamEv *ev;
+  VALUE ret;
+
+  if (meta->flags & EV_MOVED)
+    size += strlen(filename + size) + 1;
+  ev = xmalloc(offsetof(FamEv, filename) + size);
+
+  ev->code = code;
+  ev->reqnum = reqnum;
+  ev->request = request;
+  ev->hostname = NULL;
+  ev->meta = *meta;
+  ev->len = len;
+  memcpy(ev->filename, filename, size);
+
+  if (hostname && *hostname) {
+    size_t hlen = strlen(hostname) + 1;
+    ev->hostname = ALLOC_N(char, hlen);
+    memcpy(ev->hostname, hostname, hlen);
+  }
+
+  /* events are immutable; freezing them lets Ractor.make_shareable
+   * share them once they're detached from their request */
+  ret = TypedData_Wrap_Struct(cEvent, &fam_ev_type, ev);
+  OBJ_FREEZE(ret);
+  return ret;
+}
+
+static VALUE wrap_ev(const FAMEvent *fe, const EvMeta *meta)
 {
-  return Data_Wrap_Struct(cEvent, 0, -1, ev);
+  /* fetch the request before allocating; the record may only be
+   * reachable through the stack once its cancellation is acknowledged */
+  VALUE request = fe->userdata ? ((FamReq*) fe->userdata)->self : Qnil;
+
+  return new_ev(fe->code, FAMREQUEST_GETREQNUM(&(fe->fr)), request,
+                fe->hostname, fe->filename, meta);
 }
 
 /*
@@ -105,11 +804,11 @@ static VALUE wrap_ev(FAMEvent *ev)
  */
 static VALUE fam_ev_host(VALUE self)
 {
-  FAMEvent *ev;
+  FamEv *ev;
 
-  Data_Get_Struct(self, FAMEvent, ev);
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
 
-  if (ev->hostname && *ev->hostname)
+  if (ev->hostname)
     return rb_str_new2(ev->hostname);
   else 
     return rb_str_new2("localhost");
@@ -131,10 +830,10 @@ static VALUE fam_ev_host(VALUE self)
  */
 static VALUE fam_ev_file(VALUE self)
 {
-  FAMEvent *ev;
+  FamEv *ev;
 
-  Data_Get_Struct(self, FAMEvent, ev);
-  return rb_str_new2(ev->filename);
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return rb_str_new(ev->filename, ev->len);
 }
 
 /*
@@ -149,9 +848,9 @@ static VALUE fam_ev_file(VALUE self)
  */
 static VALUE fam_ev_code(VALUE self)
 {
-  FAMEvent *ev;
+  FamEv *ev;
 
-  Data_Get_Struct(self, FAMEvent, ev);
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
   return INT2FIX(ev->code);
 }
 
@@ -172,578 +871,6284 @@ static VALUE fam_ev_code(VALUE self)
  */
 static VALUE fam_ev_req(VALUE self)
 {
-  FAMEvent *ev;
+  FamEv *ev;
 
-  Data_Get_Struct(self, FAMEvent, ev);
-  return INT2NUM(FAMREQUEST_GETREQNUM(&(ev->fr)));
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return INT2NUM(ev->reqnum);
 }
 
 /*
- * Return a human-readable string-representation of a Fam::Event object.
+ * Return the Fam::Request object of the monitor that generated a
+ * Fam::Event object, or nil if it isn't known.
  *
  * Examples:
- *   puts 'event: ' << ev.to_s
+ *   fam.cancel ev.monitor if ev.code == Fam::Event::DELETED
  *
  */
-static VALUE fam_ev_to_s(VALUE self)
+static VALUE fam_ev_monitor(VALUE self)
 {
-  FAMEvent *ev;
-  char str[1024];
-  static char *ev_code_list[] = {
-    "Unknown",
-    "Changed",
-    "Deleted",
-    "StartExecuting",
-    "StopExecuting",
+  FamEv *ev;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return ev->request;
+}
+
+/*
+ * Return the context object of the monitor that generated a Fam::Event
+ * object (see Fam::Request#context), or nil.
+ *
+ * Examples:
+ *   # dispatch events without looking up request numbers
+ *   fam.monitor_file '/etc/passwd', :context => passwd_handler
+ *   ev = fam.next_event
+ *   ev.context.call(ev)
+ *
+ */
+static VALUE fam_ev_context(VALUE self)
+{
+  FamEv *ev;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return NIL_P(ev->request) ? Qnil : fam_req_context(ev->request);
+}
+
+/*
+ * Return a copy of a Fam::Event object without its monitor (and old
+ * monitor), or the event itself if it has none.  Requests belong to
+ * their connection's Ractor, so only detached events can be made
+ * shareable and passed to another Ractor; everything else about the
+ * event, including the request number, is kept.
+ *
+ * Examples:
+ *   Ractor.yield Ractor.make_shareable(fam.next_event.detach)
+ *
+ */
+static VALUE fam_ev_detach(VALUE self)
+{
+  FamEv *ev;
+  EvMeta meta;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  if (NIL_P(ev->request) && NIL_P(ev->meta.from))
+    return self;
+
+  meta = ev->meta;
+  meta.from = Qnil;
+  return new_ev(ev->code, ev->reqnum, Qnil, ev->hostname, ev->filename, &meta);
+}
+
+/*
+ * Return the old filename of a MOVED event which was put together from
+ * a DELETED and a CREATED event by move tracking (see
+ * Fam::Connection#track_moves=), or nil.  The name is relative to
+ * Fam::Event#old_monitor, just as it was in the DELETED event.
+ *
+ * Aliases:
+ *   Fam::Event#old_file
+ *
+ * Examples:
+ *   index.rename(ev.old_filename, ev.filename) if ev.old_filename
+ *
+ */
+static VALUE fam_ev_old_file(VALUE self)
+{
+  FamEv *ev;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  if (!(ev->meta.flags & EV_MOVED))
+    return Qnil;
+  return rb_str_new2(ev->filename + ev->len + 1);
+}
+
+/*
+ * Return the Fam::Request object of the monitor which reported the old
+ * filename of a tracked MOVED event (see Fam::Event#old_filename), or
+ * nil.  This differs from Fam::Event#monitor when a file moves between
+ * monitored directories.
+ *
+ * Examples:
+ *   src = ev.old_monitor || ev.monitor
+ *
+ */
+static VALUE fam_ev_old_monitor(VALUE self)
+{
+  FamEv *ev;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return (ev->meta.flags & EV_MOVED) ? ev->meta.from : Qnil;
+}
+
+/*
+ * Return the time at which a Fam::Event object was read from the
+ * backend (by the reader thread, in reader mode), as a Float.
+ *
+ * The time comes from a monotonic clock, so it is only meaningful
+ * relative to other receive times and to
+ * Process.clock_gettime(Process::CLOCK_MONOTONIC).  Coalesced events
+ * carry the receive time of the first event folded into them.
+ *
+ * Examples:
+ *   now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+ *   puts "queued for #{now - ev.received_at}s"
+ *
+ */
+static VALUE fam_ev_received_at(VALUE self)
+{
+  FamEv *ev;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return rb_float_new(ev->meta.received);
+}
+
+/*
+ * Returns true if a CHANGED event only touched the file's metadata:
+ * the monitor was added with :fingerprint => :content, and the file's
+ * inode, size and contents are the same as when it was last seen (so
+ * it was touched, or rewritten with the same bytes).  Files over 1 MiB
+ * aren't hashed, so their changes always count as content changes.
+ *
+ * Always false for other events and other monitors.
+ *
+ * Examples:
+ *   rebuild(ev.file) unless ev.metadata_only?
+ *
+ */
+static VALUE fam_ev_metadata_only(VALUE self)
+{
+  FamEv *ev;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return (ev->meta.flags & EV_METADATA_ONLY) ? Qtrue : Qfalse;
+}
+
+/*
+ * The opposite of Fam::Event#metadata_only?.  Note that this is true
+ * for every event from monitors without :fingerprint => :content,
+ * since their contents aren't known.
+ *
+ * Examples:
+ *   rebuild(ev.file) if ev.content_changed?
+ *
+ */
+static VALUE fam_ev_content_changed(VALUE self)
+{
+  FamEv *ev;
+
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  return (ev->meta.flags & EV_METADATA_ONLY) ? Qfalse : Qtrue;
+}
+
+/*
+ * Return a human-readable string-representation of a Fam::Event object.
+ *
+ * Examples:
+ *   puts 'event: ' << ev.to_s
+ *
+ */
+static VALUE fam_ev_to_s(VALUE self)
+{
+  FamEv *ev;
+  char str[1024];
+  static const char *const ev_code_list[] = {
+    "Unknown",
+    "Changed",
+    "Deleted",
+    "StartExecuting",
+    "StopExecuting",
     "Created",
     "Moved",
     "Acknowledge",
     "Exists",
     "EndExists",
+    "Overflow",
   };
 
-  Data_Get_Struct(self, FAMEvent, ev);
-  snprintf(str, 1024, "%s \"%s\" (%d)",
-           ev_code_list[ev->code],
-           ev->filename,
-           FAMREQUEST_GETREQNUM(&(ev->fr)));
+  TypedData_Get_Struct(self, FamEv, &fam_ev_type, ev);
+  if (ev->meta.flags & EV_MOVED)
+    snprintf(str, 1024, "%s \"%s\" -> \"%s\" (%d)",
+             ev_code_list[ev->code],
+             ev->filename + ev->len + 1,
+             ev->filename,
+             ev->reqnum);
+  else
+    snprintf(str, 1024, "%s \"%s\" (%d)",
+             ev_code_list[ev->code],
+             ev->filename,
+             ev->reqnum);
 
   return rb_str_new2(str);
 }
 
-/**********************/
-/* CONNECTION METHODS */
-/**********************/
-static void fam_conn_free(void *conn)
+/********************/
+/* EVENT COALESCING */
+/********************/
+
+/*
+ * When coalescing is enabled, CHANGED, CREATED and DELETED events are
+ * held for the coalescing window, and later events for the same request
+ * and filename are folded into the held event.  Held events are
+ * delivered in arrival order, so any other event (EXISTS,
+ * ACKNOWLEDGE, etc) makes everything held before it ready immediately.
+ *
+ * Move tracking (see MOVE TRACKING below) also holds DELETED events
+ * here, indexed by the identity of the deleted file, until they are
+ * paired with a CREATED event or their window passes.
+ */
+
+/*
+ * What a file looked like, for telling a rename from a new file.  A
+ * size of -1 means the file changed after it was last seen, so only
+ * the device and inode are known.
+ */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  long long mtime_ns;
+} FileId;
+
+typedef struct CoEv {
+  struct CoEv *prev, *next;   /* arrival order */
+  struct CoEv *hnext;         /* hash chain */
+  double ready;               /* time at which the event is delivered */
+  EvMeta meta;                /* receive time of the first raw event */
+  unsigned int hash;
+  int hashed;                 /* can still absorb later events */
+  int merged;                 /* has absorbed other events */
+  struct CoEv *inext;         /* file identity hash chain */
+  int moving;                 /* DELETED, waiting for its CREATED */
+  FileId id;                  /* of the deleted file, if moving */
+  int code;
+  int reqnum;
+  VALUE request;
+  char filename[1];
+} CoEv;
+
+typedef struct {
+  CoEv *head, *tail;
+  CoEv **buckets;
+  size_t mask;
+  size_t len;
+  size_t count;               /* held events */
+  unsigned long folded;       /* raw events folded into others */
+  CoEv **ibuckets;            /* moving events, by file identity */
+  size_t imask;
+  size_t ilen;
+} CoQueue;
+
+static unsigned int co_hash(int reqnum, const char *filename)
+{
+  unsigned int ret = 2166136261U ^ (unsigned int) reqnum;
+
+  while (*filename)
+    ret = (ret ^ (unsigned char) *(filename++)) * 16777619U;
+  return ret;
+}
+
+static void co_unhash(CoQueue *co, CoEv *e)
+{
+  CoEv **ep;
+
+  for (ep = &(co->buckets[e->hash & co->mask]); *ep; ep = &((*ep)->hnext)) {
+    if (*ep == e) {
+      *ep = e->hnext;
+      co->len--;
+      break;
+    }
+  }
+
+  e->hashed = 0;
+}
+
+static void co_rehash(CoQueue *co)
+{
+  size_t i, old_mask = co->mask;
+  CoEv **old = co->buckets, *e, *next;
+
+  co->mask = old_mask ? old_mask * 2 + 1 : 63;
+  co->buckets = ALLOC_N(CoEv*, co->mask + 1);
+  memset(co->buckets, 0, (co->mask + 1) * sizeof(CoEv*));
+
+  if (!old)
+    return;
+
+  for (i = 0; i <= old_mask; i++) {
+    for (e = old[i]; e; e = next) {
+      next = e->hnext;
+      e->hnext = co->buckets[e->hash & co->mask];
+      co->buckets[e->hash & co->mask] = e;
+    }
+  }
+
+  xfree(old);
+}
+
+static unsigned int co_id_hash(const FileId *id)
+{
+  unsigned long long v = (unsigned long long) id->ino ^
+                         ((unsigned long long) id->dev << 7);
+
+  return (unsigned int) (v ^ (v >> 32)) * 2654435761U;
+}
+
+/* stop waiting for a DELETED event's CREATED event */
+static void co_unhold(CoQueue *co, CoEv *e)
+{
+  CoEv **ep;
+
+  if (!e->moving)
+    return;
+
+  for (ep = &(co->ibuckets[co_id_hash(&(e->id)) & co->imask]); *ep;
+       ep = &((*ep)->inext)) {
+    if (*ep == e) {
+      *ep = e->inext;
+      co->ilen--;
+      break;
+    }
+  }
+
+  e->moving = 0;
+}
+
+static void co_irehash(CoQueue *co)
+{
+  size_t i, old_mask = co->imask;
+  CoEv **old = co->ibuckets, *e, *next;
+  unsigned int hash;
+
+  co->imask = old_mask ? old_mask * 2 + 1 : 63;
+  co->ibuckets = ALLOC_N(CoEv*, co->imask + 1);
+  memset(co->ibuckets, 0, (co->imask + 1) * sizeof(CoEv*));
+
+  if (!old)
+    return;
+
+  for (i = 0; i <= old_mask; i++) {
+    for (e = old[i]; e; e = next) {
+      next = e->inext;
+      hash = co_id_hash(&(e->id));
+      e->inext = co->ibuckets[hash & co->imask];
+      co->ibuckets[hash & co->imask] = e;
+    }
+  }
+
+  xfree(old);
+}
+
+/*
+ * Hold a DELETED event until at least the given time, so that a
+ * CREATED event for the same file can be folded into it.  Events which
+ * absorbed others (a change, then the deletion) aren't held, since a
+ * MOVED event would hide the change.
+ */
+static void co_hold(CoQueue *co, CoEv *e, const FileId *id, double until)
+{
+  unsigned int hash = co_id_hash(id);
+
+  if (e->code != FAMDeleted || e->moving || e->merged)
+    return;
+
+  if (!co->ibuckets || co->ilen > co->imask)
+    co_irehash(co);
+
+  e->id = *id;
+  e->moving = 1;
+  e->inext = co->ibuckets[hash & co->imask];
+  co->ibuckets[hash & co->imask] = e;
+  co->ilen++;
+
+  if (e->ready < until)
+    e->ready = until;
+}
+
+/* find the held DELETED event for a file, or NULL */
+static CoEv *co_find_held(CoQueue *co, const FileId *id)
+{
+  CoEv *e;
+
+  if (!co->ilen)
+    return NULL;
+
+  for (e = co->ibuckets[co_id_hash(id) & co->imask]; e; e = e->inext)
+    if (e->id.dev == id->dev && e->id.ino == id->ino &&
+        (e->id.size == -1 ||
+         (e->id.size == id->size && e->id.mtime_ns == id->mtime_ns)))
+      return e;
+
+  return NULL;
+}
+
+/*
+ * Replace a held DELETED event with a ready MOVED event for the new
+ * name in fe, in the same place in the queue.  The old filename is
+ * stored after the new one.  Returns the MOVED event, or NULL if the
+ * names don't fit in a FAMEvent.
+ */
+static CoEv *co_move(CoQueue *co, CoEv *e, const FAMEvent *fe)
+{
+  size_t len = strlen(fe->filename), old_len = strlen(e->filename);
+  CoEv *m;
+
+  if (len + old_len + 2 > sizeof(fe->filename))
+    return NULL;
+
+  m = xmalloc(offsetof(CoEv, filename) + len + old_len + 2);
+  memcpy(m->filename, fe->filename, len + 1);
+  memcpy(m->filename + len + 1, e->filename, old_len + 1);
+  m->ready = 0;
+  m->meta = e->meta;
+  m->meta.flags = EV_MOVED;
+  m->meta.from = e->request;
+  m->hash = 0;
+  m->hashed = 0;
+  m->merged = 0;
+  m->moving = 0;
+  m->code = FAMMoved;
+  m->reqnum = FAMREQUEST_GETREQNUM(&(fe->fr));
+  m->request = fe->userdata ? ((FamReq*) fe->userdata)->self : Qnil;
+
+  if (e->hashed)
+    co_unhash(co, e);
+  co_unhold(co, e);
+
+  if ((m->prev = e->prev))
+    m->prev->next = m;
+  else
+    co->head = m;
+  if ((m->next = e->next))
+    m->next->prev = m;
+  else
+    co->tail = m;
+
+  xfree(e);
+  return m;
+}
+
+static void co_remove(CoQueue *co, CoEv *e)
+{
+  if (e->hashed)
+    co_unhash(co, e);
+  co_unhold(co, e);
+
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    co->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    co->tail = e->prev;
+
+  co->count--;
+  xfree(e);
+}
+
+/* make every held event ready now, and stop folding into them */
+static void co_flush(CoQueue *co)
+{
+  CoEv *e;
+
+  for (e = co->head; e; e = e->next) {
+    e->ready = 0;
+    if (e->hashed)
+      co_unhash(co, e);
+    co_unhold(co, e);
+  }
+}
+
+/*
+ * Fold a new event code b into a held event code a.  Returns the merged
+ * code, or 0 if the two cancel out (ex. a file which was created and
+ * deleted within the window).
+ */
+static int co_merge(int a, int b)
+{
+  if (a == FAMCreated && b == FAMDeleted)
+    return 0;
+  if (a == FAMCreated && b == FAMChanged)
+    return FAMCreated;
+  if (a == FAMDeleted && b == FAMCreated)
+    return FAMChanged;
+  return b;
+}
+
+/*
+ * Hold an event in the queue, folding it into a held event for the same
+ * request and filename if there is one.  Returns the held event the
+ * event ended up in, or NULL if the two cancelled out.
+ */
+static CoEv *co_push(CoQueue *co, const FAMEvent *fe, double ready,
+                     const EvMeta *meta)
+{
+  int reqnum = FAMREQUEST_GETREQNUM(&(fe->fr));
+  int hashed = (fe->code == FAMChanged || fe->code == FAMCreated ||
+                fe->code == FAMDeleted) && ready > 0;
+  unsigned int hash = 0;
+  size_t len;
+  CoEv *e;
+  /* fetch the request before allocating, as in wrap_ev() */
+  VALUE request = fe->userdata ? ((FamReq*) fe->userdata)->self : Qnil;
+
+  if (hashed) {
+    hash = co_hash(reqnum, fe->filename);
+
+    if (co->buckets) {
+      for (e = co->buckets[hash & co->mask]; e; e = e->hnext) {
+        if (e->hash == hash && e->reqnum == reqnum &&
+            !strcmp(e->filename, fe->filename)) {
+          co->folded++;
+          e->meta.flags &= meta->flags;
+          e->merged = 1;
+          co_unhold(co, e);
+          if (!(e->code = co_merge(e->code, fe->code))) {
+            co->folded++;
+            co_remove(co, e);
+            return NULL;
+          }
+          return e;
+        }
+      }
+    }
+  } else {
+    /* keep events in order */
+    co_flush(co);
+    ready = 0;
+  }
+
+  len = strlen(fe->filename);
+  e = xmalloc(offsetof(CoEv, filename) + len + 1);
+  memcpy(e->filename, fe->filename, len + 1);
+  e->ready = ready;
+  e->meta = *meta;
+  e->hash = hash;
+  e->hashed = hashed;
+  e->merged = 0;
+  e->moving = 0;
+  e->code = fe->code;
+  e->reqnum = reqnum;
+  e->request = request;
+
+  co->count++;
+  e->next = NULL;
+  if ((e->prev = co->tail))
+    co->tail->next = e;
+  else
+    co->head = e;
+  co->tail = e;
+
+  if (hashed) {
+    if (!co->buckets || co->len > co->mask)
+      co_rehash(co);
+    e->hnext = co->buckets[hash & co->mask];
+    co->buckets[hash & co->mask] = e;
+    co->len++;
+  }
+
+  return e;
+}
+
+/*
+ * Remove the first held event if it is ready, and store it in fe and
+ * meta.  Returns 0 if no event is ready.
+ */
+static int co_shift(CoQueue *co, FAMEvent *fe, double now, EvMeta *meta)
+{
+  CoEv *e = co->head;
+  size_t len;
+
+  if (!e || e->ready > now)
+    return 0;
+
+  fe->fc = NULL;
+  fe->hostname = NULL;
+  fe->code = e->code;
+  FAMREQUEST_GETREQNUM(&(fe->fr)) = e->reqnum;
+  fe->userdata = NIL_P(e->request) ? NULL : DATA_PTR(e->request);
+  len = strlen(e->filename) + 1;
+  if (e->meta.flags & EV_MOVED)
+    len += strlen(e->filename + len) + 1;
+  memcpy(fe->filename, e->filename, len);
+  *meta = e->meta;
+
+  co_remove(co, e);
+  return 1;
+}
+
+static void co_mark(CoQueue *co)
+{
+  CoEv *e;
+
+  for (e = co->head; e; e = e->next) {
+    rb_gc_mark(e->request);
+    rb_gc_mark(e->meta.from);
+  }
+}
+
+static void co_free(CoQueue *co)
+{
+  while (co->head)
+    co_remove(co, co->head);
+
+  if (co->buckets)
+    xfree(co->buckets);
+  co->buckets = NULL;
+  co->mask = co->len = 0;
+  if (co->ibuckets)
+    xfree(co->ibuckets);
+  co->ibuckets = NULL;
+  co->imask = co->ilen = 0;
+}
+
+/*******************/
+/* DIRECTORY STATE */
+/*******************/
+
+/*
+ * The entries of a monitored directory, kept up to date from its
+ * events as they are read, so consumers can query the directory instead
+ * of replaying events.  Entries are hashed by name; with stat
+ * information, each entry also carries the size, mtime and inode from
+ * an lstat() taken when the event was read.
+ */
+typedef struct DirEnt {
+  struct DirEnt *hnext;
+  unsigned int hash;
+  int has_stat;
+  off_t size;
+  double mtime;
+  ino_t ino;
+  char name[1];
+} DirEnt;
+
+typedef struct DirState {
+  DirEnt **buckets;
+  size_t mask;
+  size_t count;
+  unsigned long generation;   /* bumped on every change */
+  int with_stat;
+  int stale;                  /* events were lost since the last scan */
+  char *path;
+} DirState;
+
+static void ds_clear(DirState *ds)
+{
+  DirEnt *e, *next;
+  size_t i;
+
+  for (i = 0; ds->buckets && i <= ds->mask; i++) {
+    for (e = ds->buckets[i]; e; e = next) {
+      next = e->hnext;
+      xfree(e);
+    }
+    ds->buckets[i] = NULL;
+  }
+  ds->count = 0;
+}
+
+static void ds_free(void *ptr)
+{
+  DirState *ds = ptr;
+
+  ds_clear(ds);
+  if (ds->buckets)
+    xfree(ds->buckets);
+  xfree(ds->path);
+  xfree(ds);
+}
+
+static size_t ds_memsize(const void *ptr)
+{
+  const DirState *ds = ptr;
+
+  return sizeof(DirState) + strlen(ds->path) + 1 +
+         (ds->buckets ? (ds->mask + 1) * sizeof(DirEnt*) : 0) +
+         ds->count * sizeof(DirEnt);
+}
+
+static const rb_data_type_t ds_type = {
+  "Fam::DirState",
+  { NULL, ds_free, ds_memsize, },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+#endif
+};
+
+static DirState *get_ds(VALUE self)
+{
+  DirState *ds;
+
+  TypedData_Get_Struct(self, DirState, &ds_type, ds);
+  return ds;
+}
+
+static DirEnt *ds_find(DirState *ds, const char *name, unsigned int hash)
+{
+  DirEnt *e;
+
+  if (!ds->buckets)
+    return NULL;
+
+  for (e = ds->buckets[hash & ds->mask]; e; e = e->hnext)
+    if (e->hash == hash && !strcmp(e->name, name))
+      return e;
+
+  return NULL;
+}
+
+static void ds_rehash(DirState *ds)
+{
+  size_t i, old_mask = ds->mask;
+  DirEnt **old = ds->buckets, *e, *next;
+
+  ds->mask = old_mask ? old_mask * 2 + 1 : 63;
+  ds->buckets = ALLOC_N(DirEnt*, ds->mask + 1);
+  memset(ds->buckets, 0, (ds->mask + 1) * sizeof(DirEnt*));
+
+  if (!old)
+    return;
+
+  for (i = 0; i <= old_mask; i++) {
+    for (e = old[i]; e; e = next) {
+      next = e->hnext;
+      e->hnext = ds->buckets[e->hash & ds->mask];
+      ds->buckets[e->hash & ds->mask] = e;
+    }
+  }
+
+  xfree(old);
+}
+
+static void ds_stat(DirState *ds, DirEnt *e, int dirfd)
+{
+  char buf[PATH_MAX];
+  struct stat st;
+  int err;
+
+  if (dirfd != -1) {
+    err = fstatat(dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW);
+  } else {
+    snprintf(buf, sizeof(buf), "%s/%s", ds->path, e->name);
+    err = lstat(buf, &st);
+  }
+
+  /* the entry may be gone already; its DELETED event will follow */
+  if ((e->has_stat = !err)) {
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    e->ino = st.st_ino;
+  }
+}
+
+/*
+ * Add an entry, or refresh its stat information if it exists.
+ */
+static void ds_add(DirState *ds, const char *name, int dirfd)
+{
+  unsigned int hash = co_hash(0, name);
+  DirEnt *e = ds_find(ds, name, hash);
+  size_t len;
+
+  if (!e) {
+    if (!ds->buckets || ds->count > ds->mask)
+      ds_rehash(ds);
+
+    len = strlen(name);
+    e = xmalloc(offsetof(DirEnt, name) + len + 1);
+    memcpy(e->name, name, len + 1);
+    e->hash = hash;
+    e->has_stat = 0;
+    e->hnext = ds->buckets[hash & ds->mask];
+    ds->buckets[hash & ds->mask] = e;
+    ds->count++;
+  } else if (!ds->with_stat) {
+    return;
+  }
+
+  if (ds->with_stat)
+    ds_stat(ds, e, dirfd);
+  ds->generation++;
+}
+
+static void ds_remove(DirState *ds, const char *name)
+{
+  unsigned int hash = co_hash(0, name);
+  DirEnt **ep, *e;
+
+  if (!ds->buckets)
+    return;
+
+  for (ep = &(ds->buckets[hash & ds->mask]); (e = *ep); ep = &(e->hnext)) {
+    if (e->hash == hash && !strcmp(e->name, name)) {
+      *ep = e->hnext;
+      xfree(e);
+      ds->count--;
+      ds->generation++;
+      return;
+    }
+  }
+}
+
+/*
+ * Apply an event for the directory to its state.
+ */
+static void ds_update(DirState *ds, const FAMEvent *fe)
+{
+  const char *name = fe->filename;
+
+  if (fe->code == FAMOverflow) {
+    ds->stale = 1;
+    return;
+  }
+
+  /* events for the directory itself carry its path */
+  if (strchr(name, '/') || !strcmp(name, ds->path) || !*name) {
+    if (fe->code == FAMDeleted && ds->count) {
+      ds_clear(ds);
+      ds->generation++;
+    }
+    return;
+  }
+
+  switch (fe->code) {
+    case FAMExists:
+    case FAMCreated:
+    case FAMChanged:
+      ds_add(ds, name, -1);
+      break;
+    case FAMDeleted:
+      ds_remove(ds, name);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Rebuild the state from a native listing of the directory.  Returns -1
+ * (with errno set) if the directory couldn't be read.
+ */
+static int ds_scan(DirState *ds)
+{
+  struct dirent *de;
+  DIR *dir;
+  int fd;
+
+  if ((fd = open(ds->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    return -1;
+  if (!(dir = fdopendir(fd))) {
+    close(fd);
+    return -1;
+  }
+
+  ds_clear(ds);
+  while ((de = readdir(dir)))
+    if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+      ds_add(ds, de->d_name, fd);
+  closedir(dir);
+
+  ds->stale = 0;
+  ds->generation++;
+  return 0;
+}
+
+static VALUE ds_new(const char *path, int with_stat)
+{
+  DirState *ds;
+  VALUE ret = TypedData_Make_Struct(cDirState, DirState, &ds_type, ds);
+  size_t len = strlen(path);
+
+  ds->with_stat = with_stat;
+  ds->path = ALLOC_N(char, len + 1);
+  memcpy(ds->path, path, len + 1);
+
+  return ret;
+}
+
+/*
+ * Return true if the directory has an entry with the given name.
+ *
+ * Aliases:
+ *   Fam::DirState#member?
+ *   Fam::DirState#key?
+ *
+ * Examples:
+ *   puts 'ready' if req.state.include?('done.flag')
+ *
+ */
+static VALUE ds_include(VALUE self, VALUE name)
+{
+  DirState *ds = get_ds(self);
+  const char *str = StringValueCStr(name);
+
+  return ds_find(ds, str, co_hash(0, str)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Return the stat information for an entry (a hash with the keys
+ * :size, :mtime and :ino), or nil if there is no such entry.  Without
+ * stat information (see Fam::Connection#monitor_directory), or if the
+ * entry couldn't be stat'ed, the hash is empty.
+ *
+ * Examples:
+ *   info = req.state.info('access.log')
+ *   puts "#{info[:size]} bytes" if info
+ *
+ */
+static VALUE ds_info(VALUE self, VALUE name)
+{
+  DirState *ds = get_ds(self);
+  const char *str = StringValueCStr(name);
+  DirEnt *e = ds_find(ds, str, co_hash(0, str));
+  VALUE ret;
+
+  if (!e)
+    return Qnil;
+
+  ret = rb_hash_new();
+  if (e->has_stat) {
+    rb_hash_aset(ret, ID2SYM(rb_intern("size")), OFFT2NUM(e->size));
+    rb_hash_aset(ret, ID2SYM(rb_intern("mtime")), rb_float_new(e->mtime));
+    rb_hash_aset(ret, ID2SYM(rb_intern("ino")), ULL2NUM(e->ino));
+  }
+  return ret;
+}
+
+/*
+ * Return the number of entries in the directory.
+ *
+ * Aliases:
+ *   Fam::DirState#length
+ *
+ */
+static VALUE ds_size(VALUE self)
+{
+  return SIZET2NUM(get_ds(self)->count);
+}
+
+/*
+ * Return true if the directory has no entries.
+ */
+static VALUE ds_empty(VALUE self)
+{
+  return get_ds(self)->count ? Qfalse : Qtrue;
+}
+
+/*
+ * Yield the name of each entry, in no particular order.  The state
+ * mustn't change while iterating (for example by reading events from
+ * the connection in the block); if it does, a RuntimeError exception
+ * is raised.
+ *
+ * Examples:
+ *   req.state.each { |name| puts name }
+ *   names = req.state.to_a
+ *
+ */
+static VALUE ds_each(VALUE self)
+{
+  DirState *ds = get_ds(self);
+  unsigned long generation = ds->generation;
+  DirEnt *e;
+  size_t i;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  for (i = 0; ds->buckets && i <= ds->mask; i++) {
+    for (e = ds->buckets[i]; e; e = e->hnext) {
+      rb_yield(rb_str_new2(e->name));
+      if (ds->generation != generation)
+        rb_raise(rb_eRuntimeError, "directory state changed during iteration");
+    }
+  }
+
+  return self;
+}
+
+/*
+ * Return the generation counter, which changes whenever an entry is
+ * added, removed or (with stat information) updated.  Compare it with
+ * a saved value to see if anything changed.
+ *
+ * Examples:
+ *   gen = state.generation
+ *   fam.drain
+ *   rebuild_index(state) if state.generation != gen
+ *
+ */
+static VALUE ds_generation(VALUE self)
+{
+  return ULONG2NUM(get_ds(self)->generation);
+}
+
+/*
+ * Return true if events for the directory were lost (an OVERFLOW event
+ * was read), so the state may be out of date.  Call
+ * Fam::DirState#rescan to rebuild it.
+ */
+static VALUE ds_stale(VALUE self)
+{
+  return get_ds(self)->stale ? Qtrue : Qfalse;
+}
+
+/*
+ * Rebuild the state from a listing of the directory, and clear the
+ * stale flag.  Returns self.
+ *
+ * Raises a Fam::Error exception if the directory couldn't be read.
+ *
+ * Examples:
+ *   state.rescan if state.stale?
+ *
+ */
+static VALUE ds_rescan(VALUE self)
+{
+  DirState *ds = get_ds(self);
+
+  if (ds_scan(ds) == -1)
+    rb_raise(eError, "Couldn't read directory \"%s\": %s", ds->path,
+             strerror(errno));
+
+  return self;
+}
+
+/*
+ * Return the path of the directory.
+ */
+static VALUE ds_path(VALUE self)
+{
+  return rb_str_new2(get_ds(self)->path);
+}
+
+/****************/
+/* FINGERPRINTS */
+/****************/
+
+/*
+ * In fingerprint mode, a request remembers the inode, size and mtime
+ * (and optionally a hash of the contents) of each file it has seen, and
+ * re-stats files on CHANGED events.  Events which leave the
+ * fingerprint alone (chmod, chown, atime updates) are dropped, and
+ * events which only moved the mtime of a file whose contents hash the
+ * same (touch) are flagged as metadata-only.
+ */
+enum {
+  FP_STAT = 1,
+  FP_CONTENT
+};
+
+/* larger files aren't hashed; the GVL is held while reading */
+#define FP_DIGEST_MAX (1024 * 1024)
+
+typedef struct FpEnt {
+  struct FpEnt *hnext;
+  unsigned int hash;
+  int has_digest;
+  ino_t ino;
+  off_t size;
+  long long mtime_ns;
+  unsigned long long digest;
+  char name[1];
+} FpEnt;
+
+typedef struct FpCache {
+  FpEnt **buckets;
+  size_t mask;
+  size_t count;
+  int mode;                   /* FP_STAT or FP_CONTENT */
+  int is_dir;                 /* event filenames are relative to path */
+  char *path;
+} FpCache;
+
+static FpCache *fp_new(const char *path, int mode, int is_dir)
+{
+  FpCache *fp = ALLOC(FpCache);
+  size_t len = strlen(path);
+
+  memset(fp, 0, sizeof(FpCache));
+  fp->mode = mode;
+  fp->is_dir = is_dir;
+  fp->path = ALLOC_N(char, len + 1);
+  memcpy(fp->path, path, len + 1);
+
+  return fp;
+}
+
+static void fp_free(FpCache *fp)
+{
+  FpEnt *e, *next;
+  size_t i;
+
+  for (i = 0; fp->buckets && i <= fp->mask; i++) {
+    for (e = fp->buckets[i]; e; e = next) {
+      next = e->hnext;
+      xfree(e);
+    }
+  }
+  if (fp->buckets)
+    xfree(fp->buckets);
+  xfree(fp->path);
+  xfree(fp);
+}
+
+static size_t fp_memsize(const FpCache *fp)
+{
+  return sizeof(FpCache) + strlen(fp->path) + 1 +
+         (fp->buckets ? (fp->mask + 1) * sizeof(FpEnt*) : 0) +
+         fp->count * sizeof(FpEnt);
+}
+
+static FpEnt **fp_find(FpCache *fp, const char *name, unsigned int hash)
+{
+  FpEnt **ep;
+
+  if (!fp->buckets)
+    return NULL;
+
+  for (ep = &(fp->buckets[hash & fp->mask]); *ep; ep = &((*ep)->hnext))
+    if ((*ep)->hash == hash && !strcmp((*ep)->name, name))
+      return ep;
+
+  return NULL;
+}
+
+static void fp_rehash(FpCache *fp)
+{
+  size_t i, old_mask = fp->mask;
+  FpEnt **old = fp->buckets, *e, *next;
+
+  fp->mask = old_mask ? old_mask * 2 + 1 : 63;
+  fp->buckets = ALLOC_N(FpEnt*, fp->mask + 1);
+  memset(fp->buckets, 0, (fp->mask + 1) * sizeof(FpEnt*));
+
+  if (!old)
+    return;
+
+  for (i = 0; i <= old_mask; i++) {
+    for (e = old[i]; e; e = next) {
+      next = e->hnext;
+      e->hnext = fp->buckets[e->hash & fp->mask];
+      fp->buckets[e->hash & fp->mask] = e;
+    }
+  }
+
+  xfree(old);
+}
+
+static void fp_remove(FpCache *fp, FpEnt **ep)
+{
+  FpEnt *e = *ep;
+
+  *ep = e->hnext;
+  xfree(e);
+  fp->count--;
+}
+
+/*
+ * Hash the contents of a regular file (64-bit FNV-1a).  Returns -1 if
+ * the file couldn't be read.
+ */
+static int fp_digest(const char *path, unsigned long long *ret)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  unsigned char buf[65536];
+  ssize_t i, len;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+    for (i = 0; i < len; i++)
+      hash = (hash ^ buf[i]) * 1099511628211ULL;
+
+  close(fd);
+  if (len == -1)
+    return -1;
+
+  *ret = hash;
+  return 0;
+}
+
+/*
+ * Apply an event to the cache.  Returns 0 if the event should be
+ * dropped, and sets EV_METADATA_ONLY in flags for metadata-only
+ * changes.  filter is the request's event filter, or NULL: files it
+ * drops every event for aren't fingerprinted, and contents aren't
+ * hashed if it drops CHANGED events.
+ */
+static int fp_process(FpCache *fp, const FamFilter *filter,
+                      const FAMEvent *fe, int *flags)
+{
+  const char *name = fe->filename;
+  unsigned int hash;
+  char path[PATH_MAX];
+  unsigned long long digest = 0;
+  long long mtime_ns;
+  int has_digest = 0;
+  struct stat st;
+  FpEnt **ep, *e;
+  size_t len;
+
+  if (fe->code != FAMExists && fe->code != FAMCreated &&
+      fe->code != FAMChanged && fe->code != FAMDeleted)
+    return 1;
+
+  if (filter && !filter_match_name(filter, name))
+    return 1;
+
+  hash = co_hash(0, name);
+  ep = fp_find(fp, name, hash);
+
+  if (fe->code == FAMDeleted) {
+    if (ep)
+      fp_remove(fp, ep);
+    return 1;
+  }
+
+  if (fp->is_dir && *name != '/')
+    snprintf(path, sizeof(path), "%s/%s", fp->path, name);
+  else
+    snprintf(path, sizeof(path), "%s", name);
+
+  /* gone already; its DELETED event will follow */
+  if (lstat(path, &st)) {
+    if (ep)
+      fp_remove(fp, ep);
+    return 1;
+  }
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  mtime_ns = st.st_mtime * 1000000000LL;
+#endif /* HAVE_STRUCT_STAT_ST_MTIM */
+
+  e = ep ? *ep : NULL;
+  if (fe->code == FAMChanged && e && e->ino == st.st_ino &&
+      e->size == st.st_size && e->mtime_ns == mtime_ns)
+    return 0;
+
+  if (fp->mode == FP_CONTENT && S_ISREG(st.st_mode) &&
+      st.st_size <= FP_DIGEST_MAX &&
+      (!filter || !filter->codes || (filter->codes & (1U << FAMChanged))))
+    has_digest = !fp_digest(path, &digest);
+
+  if (fe->code == FAMChanged && e && has_digest && e->has_digest &&
+      e->ino == st.st_ino && e->size == st.st_size && e->digest == digest)
+    *flags |= EV_METADATA_ONLY;
+
+  if (!e) {
+    if (!fp->buckets || fp->count > fp->mask)
+      fp_rehash(fp);
+
+    len = strlen(name);
+    e = xmalloc(offsetof(FpEnt, name) + len + 1);
+    memcpy(e->name, name, len + 1);
+    e->hash = hash;
+    e->hnext = fp->buckets[hash & fp->mask];
+    fp->buckets[hash & fp->mask] = e;
+    fp->count++;
+  }
+
+  e->ino = st.st_ino;
+  e->size = st.st_size;
+  e->mtime_ns = mtime_ns;
+  e->digest = digest;
+  e->has_digest = has_digest;
+
+  return 1;
+}
+
+/*
+ * Parse the :fingerprint option of a monitor call.
+ */
+static int get_fp_mode(VALUE opts)
+{
+  VALUE mode;
+
+  if (NIL_P(opts))
+    return 0;
+
+  mode = rb_hash_aref(opts, ID2SYM(rb_intern("fingerprint")));
+  if (!RTEST(mode))
+    return 0;
+  if (mode == Qtrue || mode == ID2SYM(rb_intern("stat")))
+    return FP_STAT;
+  if (mode == ID2SYM(rb_intern("content")))
+    return FP_CONTENT;
+
+  rb_raise(rb_eArgError, "invalid fingerprint mode (not true, :stat or :content)");
+  return 0;
+}
+
+/*****************/
+/* MOVE TRACKING */
+/*****************/
+
+/*
+ * FAM reports a rename as a DELETED event for the old name and a
+ * CREATED event for the new one.  With move tracking enabled, the
+ * connection remembers the identity (device, inode, size and mtime) of
+ * every entry it sees, across all of its requests.  A DELETED event
+ * for a known entry is held in the coalescing queue for the tracking
+ * window, and a CREATED event for a file with the same identity
+ * replaces it with a single MOVED event.  Renames preserve size and
+ * mtime, so a new file which happens to reuse a deleted file's inode
+ * isn't mistaken for it.
+ */
+typedef struct MvEnt {
+  struct MvEnt *hnext;
+  unsigned int hash;
+  int moved;          /* renamed along with its directory */
+  FamReq *rec;
+  FileId id;
+  char name[1];
+} MvEnt;
+
+typedef struct {
+  MvEnt **buckets;
+  size_t mask;
+  size_t count;
+  double window;        /* seconds (0 = disabled) */
+  unsigned long moves;  /* MOVED events put together */
+  FileId deleted;       /* of the entry in the last DELETED event */
+} MvCache;
+
+static MvEnt **mv_find(MvCache *mv, const FamReq *rec, const char *name,
+                       unsigned int hash)
+{
+  MvEnt **ep;
+
+  if (!mv->buckets)
+    return NULL;
+
+  for (ep = &(mv->buckets[hash & mv->mask]); *ep; ep = &((*ep)->hnext))
+    if ((*ep)->hash == hash && (*ep)->rec == rec && !strcmp((*ep)->name, name))
+      return ep;
+
+  return NULL;
+}
+
+static void mv_rehash(MvCache *mv)
+{
+  size_t i, old_mask = mv->mask;
+  MvEnt **old = mv->buckets, *e, *next;
+
+  mv->mask = old_mask ? old_mask * 2 + 1 : 63;
+  mv->buckets = ALLOC_N(MvEnt*, mv->mask + 1);
+  memset(mv->buckets, 0, (mv->mask + 1) * sizeof(MvEnt*));
+
+  if (!old)
+    return;
+
+  for (i = 0; i <= old_mask; i++) {
+    for (e = old[i]; e; e = next) {
+      next = e->hnext;
+      e->hnext = mv->buckets[e->hash & mv->mask];
+      mv->buckets[e->hash & mv->mask] = e;
+    }
+  }
+
+  xfree(old);
+}
+
+static void mv_link(MvCache *mv, MvEnt *e)
+{
+  if (!mv->buckets || mv->count > mv->mask)
+    mv_rehash(mv);
+
+  e->hnext = mv->buckets[e->hash & mv->mask];
+  mv->buckets[e->hash & mv->mask] = e;
+  mv->count++;
+}
+
+static MvEnt *mv_new_ent(FamReq *rec, const char *name, size_t len,
+                         unsigned int hash)
+{
+  MvEnt *e = xmalloc(offsetof(MvEnt, name) + len + 1);
+
+  memcpy(e->name, name, len);
+  e->name[len] = '\0';
+  e->hash = hash;
+  e->moved = 0;
+  e->rec = rec;
+  return e;
+}
+
+static void mv_remove(MvCache *mv, MvEnt **ep)
+{
+  MvEnt *e = *ep;
+
+  *ep = e->hnext;
+  xfree(e);
+  mv->count--;
+}
+
+/* forget every entry of a request */
+static void mv_forget(MvCache *mv, const FamReq *rec)
+{
+  MvEnt **ep;
+  size_t i;
+
+  for (i = 0; mv->count && i <= mv->mask; i++) {
+    for (ep = &(mv->buckets[i]); *ep; ) {
+      if ((*ep)->rec == rec)
+        mv_remove(mv, ep);
+      else
+        ep = &((*ep)->hnext);
+    }
+  }
+}
+
+static void mv_clear(MvCache *mv)
+{
+  size_t i;
+
+  for (i = 0; mv->buckets && i <= mv->mask; i++)
+    while (mv->buckets[i])
+      mv_remove(mv, &(mv->buckets[i]));
+
+  if (mv->buckets)
+    xfree(mv->buckets);
+  mv->buckets = NULL;
+  mv->mask = 0;
+}
+
+/*
+ * Rename the entries below directory from to directory to, for a
+ * request which reports nested names (a tree monitor).  The entries are
+ * marked as moved, so the CREATED events for them which the new
+ * directory's monitors generate can be dropped.
+ */
+static void mv_rename_dir(MvCache *mv, FamReq *rec, const char *from,
+                          const char *to)
+{
+  size_t i, from_len = strlen(from), to_len = strlen(to), len;
+  MvEnt **ep, *e, *n, *list = NULL;
+  char buf[PATH_MAX];
+
+  for (i = 0; mv->count && i <= mv->mask; i++) {
+    for (ep = &(mv->buckets[i]); *ep; ) {
+      e = *ep;
+      if (e->rec == rec && !strncmp(e->name, from, from_len) &&
+          e->name[from_len] == '/') {
+        *ep = e->hnext;
+        mv->count--;
+        e->hnext = list;
+        list = e;
+      } else {
+        ep = &(e->hnext);
+      }
+    }
+  }
+
+  while ((e = list)) {
+    list = e->hnext;
+    len = to_len + strlen(e->name + from_len);
+    if (len < sizeof(buf)) {
+      memcpy(buf, to, to_len);
+      memcpy(buf + to_len, e->name + from_len, len - to_len + 1);
+      n = mv_new_ent(rec, buf, len, co_hash(0, buf));
+      n->id = e->id;
+      n->moved = 1;
+      mv_link(mv, n);
+    }
+    xfree(e);
+  }
+}
+
+/*
+ * Apply an event to the cache.  visible is 0 if the event is going to
+ * be filtered out anyway, in which case it only updates the cache.
+ * Returns 0 if the event shouldn't be delivered (it was folded into a
+ * held DELETED event, or rediscovers an entry which moved with its
+ * directory), 2 if it is a DELETED event which should be held for the
+ * tracking window, and 1 otherwise.
+ */
+static int mv_process(MvCache *mv, CoQueue *co, const FAMEvent *fe,
+                      int visible)
+{
+  FamReq *rec = fe->userdata;
+  const char *name = fe->filename;
+  char path[PATH_MAX];
+  unsigned int hash;
+  struct stat st;
+  FileId id;
+  MvEnt **ep, *e;
+  CoEv *held, *m;
+
+  if (!rec || (fe->code != FAMExists && fe->code != FAMCreated &&
+               fe->code != FAMChanged && fe->code != FAMDeleted))
+    return visible;
+
+  hash = co_hash(0, name);
+  ep = mv_find(mv, rec, name, hash);
+
+  if (fe->code == FAMDeleted) {
+    if (!ep)
+      return visible;
+    mv->deleted = (*ep)->id;
+    mv_remove(mv, ep);
+    return visible ? 2 : 0;
+  }
+
+  if (*name == '/') {
+    if (snprintf(path, sizeof(path), "%s", name) >= (int) sizeof(path))
+      return visible;
+  } else if (!rec->path ||
+             snprintf(path, sizeof(path), "%s/%s", rec->path, name) >= (int) sizeof(path)) {
+    return visible;
+  }
+
+  /* gone already; its DELETED event will follow */
+  if (lstat(path, &st)) {
+    if (ep && fe->code == FAMChanged)
+      (*ep)->id.size = -1;
+    return visible;
+  }
+
+  id.dev = st.st_dev;
+  id.ino = st.st_ino;
+  id.size = st.st_size;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  id.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  id.mtime_ns = st.st_mtime * 1000000000LL;
+#endif /* HAVE_STRUCT_STAT_ST_MTIM */
+
+  if (ep) {
+    e = *ep;
+    if (e->moved && e->id.dev == id.dev && e->id.ino == id.ino) {
+      /* already reported by its directory's MOVED event */
+      e->moved = 0;
+      e->id = id;
+      return 0;
+    }
+  } else {
+    e = mv_new_ent(rec, name, strlen(name), hash);
+    mv_link(mv, e);
+  }
+  e->id = id;
+
+  if (fe->code != FAMCreated || !visible || !(held = co_find_held(co, &id)) ||
+      !(m = co_move(co, held, fe)))
+    return visible;
+
+  mv->moves++;
+  if (rec->tree && S_ISDIR(st.st_mode) && m->meta.from == rec->self)
+    mv_rename_dir(mv, rec, m->filename + strlen(m->filename) + 1, name);
+  return 0;
+}
+
+/************/
+/* BACKENDS */
+/************/
+
+#if defined(HAVE_INOTIFY_INIT1) && defined(HAVE_EVENTFD) && \
+    defined(HAVE_EPOLL_CREATE1)
+#define USE_INOTIFY 1
+#endif
+
+#if defined(USE_INOTIFY) || defined(USE_READER)
+/*
+ * Minimal int-keyed hash table.  This uses malloc() rather than the
+ * Ruby allocator, so it is safe to touch without holding the GVL.
+ */
+typedef struct IntMapEnt {
+  struct IntMapEnt *next;
+  int key;
+  void *val;
+} IntMapEnt;
+
+typedef struct {
+  IntMapEnt **buckets;
+  size_t mask;
+  size_t len;
+} IntMap;
+
+#define INTMAP_BUCKET(m, key) (((unsigned int) (key) * 2654435761U) & (m)->mask)
+
+static int intmap_init(IntMap *m)
+{
+  m->mask = 63;
+  m->len = 0;
+  m->buckets = calloc(m->mask + 1, sizeof(IntMapEnt*));
+  return m->buckets ? 0 : -1;
+}
+
+static void *intmap_get(const IntMap *m, int key)
+{
+  IntMapEnt *e;
+
+  for (e = m->buckets[INTMAP_BUCKET(m, key)]; e; e = e->next)
+    if (e->key == key)
+      return e->val;
+  return NULL;
+}
+
+static int intmap_grow(IntMap *m)
+{
+  size_t i, old_mask = m->mask;
+  IntMapEnt **old = m->buckets, *e, *next;
+
+  if (!(m->buckets = calloc(old_mask * 2 + 2, sizeof(IntMapEnt*)))) {
+    m->buckets = old;
+    return -1;
+  }
+
+  m->mask = old_mask * 2 + 1;
+  for (i = 0; i <= old_mask; i++) {
+    for (e = old[i]; e; e = next) {
+      next = e->next;
+      e->next = m->buckets[INTMAP_BUCKET(m, e->key)];
+      m->buckets[INTMAP_BUCKET(m, e->key)] = e;
+    }
+  }
+
+  free(old);
+  return 0;
+}
+
+/* insert or replace; returns -1 if out of memory */
+static int intmap_put(IntMap *m, int key, void *val)
+{
+  IntMapEnt *e;
+
+  for (e = m->buckets[INTMAP_BUCKET(m, key)]; e; e = e->next) {
+    if (e->key == key) {
+      e->val = val;
+      return 0;
+    }
+  }
+
+  if (m->len > m->mask && intmap_grow(m) == -1)
+    return -1;
+  if (!(e = malloc(sizeof(IntMapEnt))))
+    return -1;
+
+  e->key = key;
+  e->val = val;
+  e->next = m->buckets[INTMAP_BUCKET(m, key)];
+  m->buckets[INTMAP_BUCKET(m, key)] = e;
+  m->len++;
+
+  return 0;
+}
+
+static void *intmap_del(IntMap *m, int key)
+{
+  IntMapEnt **ep, *e;
+  void *ret;
+
+  for (ep = &(m->buckets[INTMAP_BUCKET(m, key)]); (e = *ep); ep = &(e->next)) {
+    if (e->key == key) {
+      ret = e->val;
+      *ep = e->next;
+      free(e);
+      m->len--;
+      return ret;
+    }
+  }
+
+  return NULL;
+}
+
+static void intmap_free(IntMap *m)
+{
+  IntMapEnt *e, *next;
+  size_t i;
+
+  if (!m->buckets)
+    return;
+
+  for (i = 0; i <= m->mask; i++) {
+    for (e = m->buckets[i]; e; e = next) {
+      next = e->next;
+      free(e);
+    }
+  }
+
+  free(m->buckets);
+  m->buckets = NULL;
+}
+#endif /* USE_INOTIFY || USE_READER */
+
+#ifdef USE_INOTIFY
+/*
+ * The inotify backend emulates the subset of the FAM API used by this
+ * extension directly on top of inotify, so no FAM or Gamin daemon is
+ * needed.  Requests for the same inode share a watch descriptor, and
+ * EXISTS, END_EXIST and ACKNOWLEDGE events are synthesized into a queue.
+ *
+ * The descriptor handed out to callers is an epoll descriptor watching
+ * both the inotify descriptor and an eventfd that stays readable while
+ * the synthesized event queue is non-empty, so select()ing on
+ * Fam::Connection#fd works the same way it does with FAM.
+ */
+#define INO_MASK (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                  IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                  IN_MOVE_SELF)
+
+typedef struct InoWatch {
+  struct InoWatch *next;  /* next request sharing this watch descriptor */
+  int wd;                 /* -1 once the kernel has dropped the watch */
+  int reqnum;
+  int is_dir;
+  void *userdata;
+  char *path;
+} InoWatch;
+
+typedef struct InoEv {
+  struct InoEv *next;
+  int reqnum;
+  int code;
+  void *userdata;
+  char filename[1];
+} InoEv;
+
+typedef struct {
+  int fd;           /* inotify descriptor */
+  int evfd;         /* readable while the event queue is non-empty */
+  int epfd;         /* watches fd and evfd */
+  int next_reqnum;
+  int no_exists;
+  IntMap wds;       /* watch descriptor -> InoWatch list */
+  IntMap reqs;      /* request number -> InoWatch */
+  InoEv *head, *tail;
+} InoConn;
+
+static int ino_push(InoConn *ino, int reqnum, void *userdata, int code,
+                    const char *filename)
+{
+  size_t len = strlen(filename);
+  InoEv *ev = malloc(offsetof(InoEv, filename) + len + 1);
+  uint64_t one = 1;
+
+  if (!ev)
+    return -1;
+
+  ev->next = NULL;
+  ev->reqnum = reqnum;
+  ev->code = code;
+  ev->userdata = userdata;
+  memcpy(ev->filename, filename, len + 1);
+
+  if (ino->tail) {
+    ino->tail->next = ev;
+  } else {
+    ino->head = ev;
+    if (write(ino->evfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+      return -1;
+  }
+  ino->tail = ev;
+
+  return 0;
+}
+
+static InoEv *ino_shift(InoConn *ino)
+{
+  InoEv *ev = ino->head;
+  uint64_t val;
+
+  if (ev && !(ino->head = ev->next)) {
+    ino->tail = NULL;
+    if (read(ino->evfd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+      return NULL;
+  }
+
+  return ev;
+}
+
+/* forget a watch descriptor the kernel has dropped */
+static void ino_forget_wd(InoConn *ino, int wd)
+{
+  InoWatch *w;
+
+  for (w = intmap_del(&ino->wds, wd); w; w = w->next)
+    w->wd = -1;
+}
+
+static int ino_translate(InoConn *ino, const struct inotify_event *ie)
+{
+  InoWatch *w;
+
+  if (ie->mask & IN_IGNORED) {
+    ino_forget_wd(ino, ie->wd);
+    return 0;
+  }
+
+  /* the kernel queue overflowed, so events were lost */
+  if (ie->mask & IN_Q_OVERFLOW)
+    return ino_push(ino, 0, NULL, FAMOverflow, "");
+
+  for (w = intmap_get(&ino->wds, ie->wd); w; w = w->next) {
+    const char *name = w->path;
+    int code = 0;
+
+    if (ie->len > 0) {
+      /* event for a directory entry */
+      if (!w->is_dir)
+        continue;
+
+      name = ie->name;
+      if (ie->mask & (IN_CREATE | IN_MOVED_TO))
+        code = FAMCreated;
+      else if (ie->mask & (IN_DELETE | IN_MOVED_FROM))
+        code = FAMDeleted;
+      else if (ie->mask & (IN_MODIFY | IN_ATTRIB))
+        code = FAMChanged;
+    } else {
+      /* event for the monitored path itself */
+      if (ie->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+        code = FAMDeleted;
+      else if (ie->mask & (IN_MODIFY | IN_ATTRIB))
+        code = FAMChanged;
+    }
+
+    if (code && ino_push(ino, w->reqnum, w->userdata, code, name) == -1)
+      return -1;
+  }
+
+  /* FAM considers a moved path deleted, so stop watching it */
+  if (ie->mask & IN_MOVE_SELF)
+    inotify_rm_watch(ino->fd, ie->wd);
+
+  return 0;
+}
+
+/* read and translate whatever the kernel has queued, without blocking */
+static int ino_read(InoConn *ino)
+{
+  union {
+    struct inotify_event ev;
+    char buf[4096];
+  } u;
+  ssize_t len;
+  char *p;
+
+  if ((len = read(ino->fd, u.buf, sizeof(u.buf))) == -1)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+  for (p = u.buf; p < u.buf + len; ) {
+    struct inotify_event *ie = (struct inotify_event*) p;
+
+    if (ino_translate(ino, ie) == -1)
+      return -1;
+    p += sizeof(struct inotify_event) + ie->len;
+  }
+
+  return 0;
+}
+
+static int ino_open(InoConn *ino)
+{
+  struct epoll_event ev;
+
+  memset(ino, 0, sizeof(InoConn));
+  ino->fd = ino->evfd = ino->epfd = -1;
+  ino->next_reqnum = 1;
+
+  if (intmap_init(&ino->wds) == -1 || intmap_init(&ino->reqs) == -1)
+    return -1;
+
+  if ((ino->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+      (ino->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+      (ino->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    return -1;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if (epoll_ctl(ino->epfd, EPOLL_CTL_ADD, ino->fd, &ev) == -1 ||
+      epoll_ctl(ino->epfd, EPOLL_CTL_ADD, ino->evfd, &ev) == -1)
+    return -1;
+
+  return 0;
+}
+
+static void ino_close(InoConn *ino)
+{
+  InoEv *ev;
+  size_t i;
+
+  while ((ev = ino->head)) {
+    ino->head = ev->next;
+    free(ev);
+  }
+  ino->tail = NULL;
+
+  if (ino->reqs.buckets) {
+    for (i = 0; i <= ino->reqs.mask; i++) {
+      IntMapEnt *e;
+
+      for (e = ino->reqs.buckets[i]; e; e = e->next) {
+        InoWatch *w = e->val;
+        free(w->path);
+        free(w);
+      }
+    }
+  }
+
+  intmap_free(&ino->reqs);
+  intmap_free(&ino->wds);
+
+  if (ino->epfd != -1)
+    close(ino->epfd);
+  if (ino->evfd != -1)
+    close(ino->evfd);
+  if (ino->fd != -1)
+    close(ino->fd);
+  ino->fd = ino->evfd = ino->epfd = -1;
+}
+
+/* queue EXISTS events for a new request, like FAM does */
+static int ino_exists(InoConn *ino, const InoWatch *w)
+{
+  struct dirent *de;
+  DIR *dir;
+
+  if (ino_push(ino, w->reqnum, w->userdata, FAMExists, w->path) == -1)
+    return -1;
+
+  if (w->is_dir) {
+    if (!(dir = opendir(w->path)))
+      return -1;
+
+    while ((de = readdir(dir))) {
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+        continue;
+      if (ino_push(ino, w->reqnum, w->userdata, FAMExists, de->d_name) == -1) {
+        closedir(dir);
+        return -1;
+      }
+    }
+
+    closedir(dir);
+  }
+
+  return ino_push(ino, w->reqnum, w->userdata, FAMEndExist, w->path);
+}
+
+/*
+ * Take a watch off its descriptor's list, removing the kernel watch if
+ * it was the only one.
+ */
+static void ino_unwatch(InoConn *ino, InoWatch *w)
+{
+  InoWatch *head, **wp;
+
+  if (w->wd == -1)
+    return;
+
+  head = intmap_get(&ino->wds, w->wd);
+  if (head == w) {
+    if (w->next) {
+      intmap_put(&ino->wds, w->wd, w->next);
+    } else {
+      intmap_del(&ino->wds, w->wd);
+      inotify_rm_watch(ino->fd, w->wd);
+    }
+  } else if (head) {
+    for (wp = &(head->next); *wp; wp = &((*wp)->next)) {
+      if (*wp == w) {
+        *wp = w->next;
+        break;
+      }
+    }
+  }
+}
+
+/* drop the queued events of a request that failed to start */
+static void ino_drop(InoConn *ino, int reqnum)
+{
+  InoEv **ep, *ev;
+  uint64_t val;
+  ssize_t ignored;
+
+  for (ep = &(ino->head); (ev = *ep); ) {
+    if (ev->reqnum == reqnum) {
+      *ep = ev->next;
+      free(ev);
+    } else {
+      ep = &(ev->next);
+    }
+  }
+
+  /* fix the tail, and clear the eventfd if the queue is now empty */
+  ino->tail = NULL;
+  for (ev = ino->head; ev; ev = ev->next)
+    ino->tail = ev;
+  if (!ino->head) {
+    ignored = read(ino->evfd, &val, sizeof(val));
+    (void) ignored;
+  }
+}
+
+/* free a watch that never made it, setting errno to err */
+static int ino_watch_fail(InoWatch *w, int err)
+{
+  free(w->path);
+  free(w);
+  errno = err;
+  return -1;
+}
+
+static int ino_monitor(InoConn *ino, const char *path, FAMRequest *req,
+                       void *userdata, int is_dir)
+{
+  InoWatch *w;
+  int wd, err;
+
+  wd = inotify_add_watch(ino->fd, path, INO_MASK | (is_dir ? IN_ONLYDIR : 0));
+  if (wd == -1)
+    return -1;
+
+  if (!(w = calloc(1, sizeof(InoWatch))) || !(w->path = strdup(path))) {
+    /* the kernel watch is ours alone unless another request shares it */
+    if (!intmap_get(&ino->wds, wd))
+      inotify_rm_watch(ino->fd, wd);
+    free(w);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  w->wd = wd;
+  w->reqnum = ino->next_reqnum++;
+  w->is_dir = is_dir;
+  w->userdata = userdata;
+  w->next = intmap_get(&ino->wds, wd);
+
+  if (intmap_put(&ino->wds, wd, w) == -1) {
+    if (!w->next)
+      inotify_rm_watch(ino->fd, wd);
+    return ino_watch_fail(w, ENOMEM);
+  }
+  if (intmap_put(&ino->reqs, w->reqnum, w) == -1) {
+    ino_unwatch(ino, w);
+    return ino_watch_fail(w, ENOMEM);
+  }
+
+  FAMREQUEST_GETREQNUM(req) = w->reqnum;
+
+  /* the caller frees userdata when this fails, so nothing may refer to
+   * it afterwards: not the watch, and not the queued EXISTS events */
+  if (!ino->no_exists && ino_exists(ino, w) == -1) {
+    err = errno;
+    intmap_del(&ino->reqs, w->reqnum);
+    ino_unwatch(ino, w);
+    ino_drop(ino, w->reqnum);
+    return ino_watch_fail(w, err);
+  }
+
+  return 0;
+}
+
+static int ino_cancel(InoConn *ino, const FAMRequest *req)
+{
+  InoWatch *w;
+  int err;
+
+  if (!(w = intmap_del(&ino->reqs, FAMREQUEST_GETREQNUM(req)))) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ino_unwatch(ino, w);
+
+  err = ino_push(ino, w->reqnum, w->userdata, FAMAcknowledge, w->path);
+  free(w->path);
+  free(w);
+
+  return err;
+}
+
+static int ino_pending(InoConn *ino)
+{
+  if (!ino->head && ino_read(ino) == -1)
+    return -1;
+  return ino->head ? 1 : 0;
+}
+
+static int ino_next(InoConn *ino, FAMEvent *fe)
+{
+  InoEv *ev;
+
+  while (!ino->head) {
+    struct pollfd pfd;
+
+    pfd.fd = ino->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+      return -1;
+    if (ino_read(ino) == -1)
+      return -1;
+  }
+
+  if (!(ev = ino_shift(ino)))
+    return -1;
+
+  fe->fc = NULL;
+  FAMREQUEST_GETREQNUM(&(fe->fr)) = ev->reqnum;
+  fe->hostname = NULL;
+  fe->userdata = ev->userdata;
+  fe->code = ev->code;
+  strncpy(fe->filename, ev->filename, sizeof(fe->filename) - 1);
+  fe->filename[sizeof(fe->filename) - 1] = '\0';
+  free(ev);
+
+  return 1;
+}
+#endif /* USE_INOTIFY */
+
+enum {
+  BACKEND_FAM,
+  BACKEND_INOTIFY
+};
+
+/*
+ * Connection counters, for Fam::Connection#stats.  These are plain
+ * increments on the consuming thread (or under the backend lock), so
+ * they're always on.
+ */
+typedef struct {
+  unsigned long events[FAMOverflow + 1]; /* delivered, by code */
+  unsigned long read;                    /* raw events read */
+  unsigned long filtered;                /* raw events not delivered */
+  unsigned long requests;                /* requests registered */
+  unsigned long live;                    /* requests on the request list */
+  unsigned long cancelled;               /* cancel_monitor calls */
+  unsigned long pending_calls;           /* backend pending checks */
+  unsigned long waits;                   /* blocking waits */
+  double wait_time;                      /* seconds spent in them */
+  unsigned long filename_bytes;          /* filename data delivered */
+  unsigned long unchanged;               /* dropped by fingerprints */
+} ConnStats;
+
+/*
+ * A Fam::Connection.  All access to the underlying event source goes
+ * through the backend_* functions below, which follow the FAM
+ * conventions (return -1 on error) regardless of the backend.
+ */
+typedef struct FamConn {
+  int backend;
+  int open;
+  int err;            /* errno from the last failed inotify call */
+  FAMConnection fc;
+#ifdef USE_INOTIFY
+  InoConn ino;
+#endif /* USE_INOTIFY */
+  FamReq *reqs;       /* live requests */
+  struct Tree *trees; /* tree monitors */
+  double coalesce;    /* coalescing window, in seconds (0 = disabled) */
+  CoQueue co;         /* held events */
+  unsigned long overflows; /* OVERFLOW events delivered */
+  ConnStats stats;
+  MvCache mv;         /* move tracking */
+  EvMeta meta;        /* of the last event read */
+  Hist *latency;      /* handling latencies, or NULL */
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  VALUE io;           /* IO for the wait descriptor, for fiber schedulers */
+  int io_fd;
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+#ifdef USE_READER
+  struct Reader *reader; /* reader thread, or NULL */
+#endif /* USE_READER */
+} FamConn;
+
+#ifdef USE_INOTIFY
+#define BACKEND_CALL(conn, fam_expr, ino_expr) \
+  (((conn)->backend == BACKEND_INOTIFY) ? \
+    (((ino_expr) == -1) ? ((conn)->err = errno, -1) : 0) : (fam_expr))
+#else
+#define BACKEND_CALL(conn, fam_expr, ino_expr) (fam_expr)
+#endif /* USE_INOTIFY */
+
+static const char *backend_error(FamConn *conn)
+{
+  if (conn->backend == BACKEND_INOTIFY)
+    return strerror(conn->err);
+  return fam_error();
+}
+
+static int backend_fd(FamConn *conn)
+{
+#ifdef USE_INOTIFY
+  if (conn->backend == BACKEND_INOTIFY)
+    return conn->ino.epfd;
+#endif /* USE_INOTIFY */
+  return FAMCONNECTION_GETFD(&(conn->fc));
+}
+
+static int backend_pending(FamConn *conn)
+{
+  conn->stats.pending_calls++;
+#ifdef USE_INOTIFY
+  if (conn->backend == BACKEND_INOTIFY) {
+    int ret = ino_pending(&(conn->ino));
+    if (ret == -1)
+      conn->err = errno;
+    return ret;
+  }
+#endif /* USE_INOTIFY */
+  return FAMPending(&(conn->fc));
+}
+
+static int backend_next(FamConn *conn, FAMEvent *fe)
+{
+  int ret = BACKEND_CALL(conn, FAMNextEvent(&(conn->fc), fe),
+                         ino_next(&(conn->ino), fe));
+
+  if (ret != -1)
+    FAM_PROBE3(event_receive, fe->code, FAMREQUEST_GETREQNUM(&(fe->fr)),
+               fe->filename);
+  return ret;
+}
+
+/*****************/
+/* READER THREAD */
+/*****************/
+
+#define READER_DEFAULT_SIZE 4096
+#define READER_MIN_SIZE     16
+
+/* what the reader thread does when the ring is full */
+enum {
+  OVERFLOW_BLOCK,       /* stop reading until there is room */
+  OVERFLOW_DROP_OLDEST, /* drop queued events to make room */
+  OVERFLOW_DROP_NEWEST, /* drop incoming events */
+  OVERFLOW_RESCAN       /* drop incoming events, one OVERFLOW per request */
+};
+
+#ifdef USE_READER
+/*
+ * In reader mode, a native thread reads raw events from the backend
+ * into a bounded ring as soon as they arrive, so the daemon (or kernel)
+ * queue keeps draining while Ruby is busy.  Only the raw events cross
+ * the ring; tree bookkeeping, filtering and coalescing still happen on
+ * the consuming Ruby thread.
+ *
+ * The reader owns the tail and the consumer owns the head, except that
+ * the drop-oldest policy lets the reader discard the oldest event.  So
+ * both sides claim the head with a compare-and-swap, and the consumer
+ * only dereferences a slot once its claim succeeds.  Neither side
+ * takes a lock to push or shift.  The lock serializes calls into the
+ * backend (libfam isn't thread-safe), and doubles as the mutex for the
+ * "ring has space" condition the reader sleeps on under the blocking
+ * policy.
+ *
+ * When events are dropped, the reader queues an OVERFLOW pseudo-event
+ * (per request under the rescan policy) on a private backlog, which is
+ * moved into the ring as soon as there is room.  ACKNOWLEDGE events are
+ * never dropped, since the request records they release would leak;
+ * they wait on the backlog too.
+ */
+#ifdef __ATOMIC_ACQUIRE
+#define RING_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_PEEK(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define RING_STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define RING_CAS(p, o, n) __atomic_compare_exchange_n((p), &(o), (n), 0, \
+                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define RING_ADD(p, v)    __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#else
+#define RING_LOAD(p)      (__sync_synchronize(), *(volatile size_t*) (p))
+#define RING_PEEK(p)      (*(volatile __typeof__(*(p))*) (p))
+#define RING_STORE(p, v)  (__sync_synchronize(), *(volatile size_t*) (p) = (v))
+#define RING_CAS(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define RING_ADD(p, v)    __sync_add_and_fetch((p), (v))
+#endif /* __ATOMIC_ACQUIRE */
+
+typedef struct {
+  int code;
+  int reqnum;
+  void *userdata;
+  double received;            /* when the reader read it */
+  char *filename;             /* malloc'd by the reader */
+} RingEv;
+
+typedef struct BackEv {
+  struct BackEv *next;
+  RingEv ev;
+} BackEv;
+
+typedef struct Reader {
+  RingEv *slots;
+  size_t mask;                /* capacity - 1 (capacity is a power of 2) */
+  size_t head;                /* next slot to shift */
+  size_t tail;                /* next slot to fill (reader) */
+  int policy;
+  pthread_t thread;
+  pthread_mutex_t lock;       /* backend calls */
+  pthread_cond_t space;       /* signalled when a full ring is shifted */
+  int notify[2];              /* reader -> consumer wakeups */
+  int wake[2];                /* consumer -> reader wakeups */
+  int stopping;
+  size_t done;                /* reader thread has exited */
+  size_t dropped;             /* events dropped by the policy */
+  size_t overflow_queued;     /* undelivered connection-wide OVERFLOW */
+  char error[256];            /* why the reader exited, if it failed */
+
+  /* private to the reader thread */
+  BackEv *back_head, *back_tail;
+  IntMap lost;                /* rescan: reqnums with an OVERFLOW queued */
+} Reader;
+
+static void conn_lock(FamConn *conn)
+{
+  if (conn->reader)
+    pthread_mutex_lock(&(conn->reader->lock));
+}
+
+static void conn_unlock(FamConn *conn)
+{
+  if (conn->reader)
+    pthread_mutex_unlock(&(conn->reader->lock));
+}
+
+static void reader_fail(FamConn *conn, const char *what)
+{
+  Reader *r = conn->reader;
+
+  snprintf(r->error, sizeof(r->error), "%s: %s", what, backend_error(conn));
+}
+
+static void reader_nomem(Reader *r)
+{
+  snprintf(r->error, sizeof(r->error), "Couldn't queue FAM event: %s",
+           strerror(ENOMEM));
+}
+
+static size_t ring_space(Reader *r)
+{
+  return r->mask + 1 - (r->tail - RING_LOAD(&(r->head)));
+}
+
+/* store an event (taking ownership of its filename) in the next slot */
+static void ring_put(Reader *r, const RingEv *ev)
+{
+  r->slots[r->tail & r->mask] = *ev;
+  RING_STORE(&(r->tail), r->tail + 1);
+}
+
+/*
+ * Discard the oldest event in the ring into ev (which then owns the
+ * filename).  Returns 0 if the consumer shifted it first.
+ */
+static int ring_discard(Reader *r, RingEv *ev)
+{
+  size_t head = RING_LOAD(&(r->head));
+
+  if (head == r->tail)
+    return 0;
+
+  *ev = r->slots[head & r->mask];
+  return RING_CAS(&(r->head), head, head + 1);
+}
+
+/* events which must not be dropped */
+static int ev_essential(int code)
+{
+  return code == FAMAcknowledge || code == FAMOverflow;
+}
+
+/*
+ * Append an event to the backlog, taking ownership of its filename.
+ * Returns -1 on failure.
+ */
+static int backlog_add(Reader *r, const RingEv *ev)
+{
+  BackEv *b;
+
+  if (!(b = malloc(sizeof(BackEv))))
+    return -1;
+
+  b->next = NULL;
+  b->ev = *ev;
+  if (r->back_tail)
+    r->back_tail->next = b;
+  else
+    r->back_head = b;
+  r->back_tail = b;
+
+  return 0;
+}
+
+/* move backlog events into the ring while there is room */
+static void backlog_flush(Reader *r)
+{
+  BackEv *b;
+
+  while ((b = r->back_head) && ring_space(r)) {
+    if (!(r->back_head = b->next))
+      r->back_tail = NULL;
+
+    if (b->ev.code == FAMOverflow && b->ev.userdata)
+      intmap_del(&(r->lost), b->ev.reqnum);
+
+    ring_put(r, &(b->ev));
+    free(b);
+  }
+}
+
+/*
+ * Account for a dropped event (whose filename has already been freed),
+ * and queue the matching OVERFLOW event.  Returns -1 on failure.
+ */
+static int reader_lost(Reader *r, int reqnum, void *userdata)
+{
+  RingEv ev;
+
+  RING_ADD(&(r->dropped), 1);
+
+  if (r->policy == OVERFLOW_RESCAN && userdata) {
+    if (intmap_get(&(r->lost), reqnum))
+      return 0;
+    if (intmap_put(&(r->lost), reqnum, userdata) == -1)
+      return -1;
+  } else {
+    /* one is enough until the consumer sees it */
+    if (RING_LOAD(&(r->overflow_queued)))
+      return 0;
+    RING_STORE(&(r->overflow_queued), 1);
+    reqnum = 0;
+    userdata = NULL;
+  }
+
+  ev.code = FAMOverflow;
+  ev.reqnum = reqnum;
+  ev.userdata = userdata;
+  ev.received = fam_now();
+  if (!(ev.filename = strdup("")) || backlog_add(r, &ev) == -1) {
+    free(ev.filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Make room for one event under the drop-oldest policy.  Returns 1 if
+ * there is room, 0 if the ring is clogged with events which can't be
+ * dropped, or -1 on failure.
+ */
+static int reader_make_room(Reader *r)
+{
+  size_t tries = r->mask + 1;
+  RingEv old;
+
+  for (;;) {
+    backlog_flush(r);
+    if (!r->back_head && ring_space(r))
+      return 1;
+    if (!tries--)
+      return 0;
+
+    if (!ring_space(r) && ring_discard(r, &old)) {
+      if (ev_essential(old.code)) {
+        if (backlog_add(r, &old) == -1)
+          return -1;
+      } else {
+        free(old.filename);
+        if (reader_lost(r, old.reqnum, old.userdata) == -1)
+          return -1;
+      }
+    }
+  }
+}
+
+/*
+ * Queue a newly read event, applying the overflow policy if the ring
+ * (or the backlog ahead of it) is full.  Returns -1 on failure.
+ */
+static int reader_queue(Reader *r, const FAMEvent *fe)
+{
+  RingEv ev;
+  int room;
+
+  ev.code = fe->code;
+  ev.reqnum = FAMREQUEST_GETREQNUM(&(fe->fr));
+  ev.userdata = fe->userdata;
+  ev.received = fam_now();
+
+  /* rescan: events for requests awaiting an OVERFLOW are redundant */
+  if (r->policy == OVERFLOW_RESCAN && ev.userdata &&
+      !ev_essential(ev.code) && intmap_get(&(r->lost), ev.reqnum))
+    return reader_lost(r, ev.reqnum, ev.userdata);
+
+  if (r->policy == OVERFLOW_DROP_OLDEST) {
+    if ((room = reader_make_room(r)) == -1)
+      return -1;
+  } else {
+    backlog_flush(r);
+    room = !r->back_head && ring_space(r);
+  }
+
+  if (!room && !ev_essential(ev.code))
+    return reader_lost(r, ev.reqnum, ev.userdata);
+
+  if (!(ev.filename = strdup(fe->filename)))
+    return -1;
+
+  if (room) {
+    ring_put(r, &ev);
+    return 0;
+  }
+
+  if (backlog_add(r, &ev) == -1) {
+    free(ev.filename);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Move pending events from the backend into the ring until the backend
+ * runs out (or, under the blocking policy, the ring fills up).  Called
+ * with the lock held.  Returns the number of events read, or -1 on
+ * error.
+ */
+static long reader_fill(FamConn *conn)
+{
+  Reader *r = conn->reader;
+  long ret = 0;
+  FAMEvent fe;
+  int err;
+
+  backlog_flush(r);
+
+  while (r->policy != OVERFLOW_BLOCK || ring_space(r)) {
+    if ((err = backend_pending(conn)) == -1) {
+      reader_fail(conn, "Couldn't check for pending FAM events");
+      return -1;
+    }
+    if (!err)
+      break;
+
+    if (backend_next(conn, &fe) == -1) {
+      reader_fail(conn, "Couldn't get next FAM event");
+      return -1;
+    }
+
+    if (r->policy == OVERFLOW_BLOCK) {
+      RingEv ev;
+
+      ev.code = fe.code;
+      ev.reqnum = FAMREQUEST_GETREQNUM(&(fe.fr));
+      ev.userdata = fe.userdata;
+      ev.received = fam_now();
+      if (!(ev.filename = strdup(fe.filename))) {
+        reader_nomem(r);
+        return -1;
+      }
+      ring_put(r, &ev);
+    } else if (reader_queue(r, &fe) == -1) {
+      reader_nomem(r);
+      return -1;
+    }
+
+    ret++;
+  }
+
+  return ret;
+}
+
+static void pipe_poke(int fd)
+{
+  char c = 0;
+  ssize_t ignored = write(fd, &c, 1);
+  (void) ignored;
+}
+
+static void pipe_clear(int fd)
+{
+  char buf[64];
+
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+static void *reader_main(void *ptr)
+{
+  FamConn *conn = ptr;
+  Reader *r = conn->reader;
+  struct pollfd pfd[2];
+  int full = 0, stopping;
+  size_t tail;
+  long num;
+
+  pfd[0].fd = backend_fd(conn);
+  pfd[0].events = POLLIN;
+  pfd[1].fd = r->wake[0];
+  pfd[1].events = POLLIN;
+
+  for (;;) {
+    /* after a full ring, the backend may still hold buffered events
+     * which won't make the descriptor readable, so skip the wait */
+    if (!full) {
+      pfd[0].revents = pfd[1].revents = 0;
+      if (poll(pfd, 2, -1) == -1) {
+        if (errno == EINTR)
+          continue;
+        snprintf(r->error, sizeof(r->error),
+                 "Couldn't wait for FAM events: %s", strerror(errno));
+        break;
+      }
+      if (pfd[1].revents)
+        pipe_clear(r->wake[0]);
+      if (!(pfd[0].revents & POLLIN) &&
+          (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+        snprintf(r->error, sizeof(r->error),
+                 "Couldn't wait for FAM events: connection closed");
+        break;
+      }
+    }
+
+    pthread_mutex_lock(&(r->lock));
+    tail = r->tail;
+    num = r->stopping ? 0 : reader_fill(conn);
+    full = (num != -1 && r->policy == OVERFLOW_BLOCK && !ring_space(r));
+
+    /* wake the consumer before waiting for it to make room */
+    if (r->tail != tail)
+      pipe_poke(r->notify[1]);
+
+    /* ring is full: sleep until the consumer makes room */
+    while (full && !r->stopping && !ring_space(r))
+      pthread_cond_wait(&(r->space), &(r->lock));
+    stopping = r->stopping;
+    pthread_mutex_unlock(&(r->lock));
+
+    if (num == -1 || stopping)
+      break;
+  }
+
+  RING_STORE(&(r->done), 1);
+  pipe_poke(r->notify[1]);
+  return NULL;
+}
+
+static int set_pipe_flags(int *fds)
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+    if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1)
+      return -1;
+  return 0;
+}
+
+static void reader_free(Reader *r)
+{
+  BackEv *b, *next;
+  size_t i;
+
+  for (i = r->head; i != r->tail; i++)
+    free(r->slots[i & r->mask].filename);
+  for (b = r->back_head; b; b = next) {
+    next = b->next;
+    free(b->ev.filename);
+    free(b);
+  }
+  if (r->notify[0] != -1) {
+    close(r->notify[0]);
+    close(r->notify[1]);
+  }
+  if (r->wake[0] != -1) {
+    close(r->wake[0]);
+    close(r->wake[1]);
+  }
+  pthread_mutex_destroy(&(r->lock));
+  pthread_cond_destroy(&(r->space));
+  intmap_free(&(r->lost));
+  free(r->slots);
+  free(r);
+}
+
+/*
+ * Start the reader thread with a ring of at least size events and the
+ * given overflow policy.  Returns -1 and sets errno on failure.
+ */
+static int reader_start(FamConn *conn, long size, int policy)
+{
+  Reader *r;
+  size_t cap = READER_MIN_SIZE;
+  int err;
+
+  if ((size_t) size > ((size_t) -1 >> 1) / sizeof(RingEv)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  while (cap < (size_t) size)
+    cap <<= 1;
+
+  if (!(r = calloc(1, sizeof(Reader))))
+    return -1;
+  r->notify[0] = r->notify[1] = r->wake[0] = r->wake[1] = -1;
+  pthread_mutex_init(&(r->lock), NULL);
+  pthread_cond_init(&(r->space), NULL);
+  r->mask = cap - 1;
+  r->policy = policy;
+
+  if (!(r->slots = calloc(cap, sizeof(RingEv))) ||
+      intmap_init(&(r->lost)) == -1 ||
+      pipe(r->notify) == -1 || set_pipe_flags(r->notify) == -1 ||
+      pipe(r->wake) == -1 || set_pipe_flags(r->wake) == -1) {
+    err = errno ? errno : ENOMEM;
+    reader_free(r);
+    errno = err;
+    return -1;
+  }
+
+  conn->reader = r;
+  if ((err = pthread_create(&(r->thread), NULL, reader_main, conn))) {
+    conn->reader = NULL;
+    reader_free(r);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Stop and join the reader thread, and free the ring.  Events still in
+ * the ring are discarded.
+ */
+static void reader_stop(FamConn *conn)
+{
+  Reader *r = conn->reader;
+
+  if (!r)
+    return;
+
+  pthread_mutex_lock(&(r->lock));
+  r->stopping = 1;
+  pthread_cond_signal(&(r->space));
+  pthread_mutex_unlock(&(r->lock));
+  pipe_poke(r->wake[1]);
+
+  pthread_join(r->thread, NULL);
+  conn->reader = NULL;
+  reader_free(r);
+}
+
+/*
+ * Check for raw events from the ring, raising a Fam::Error exception if
+ * the reader thread has failed.
+ */
+static int reader_pending(Reader *r)
+{
+  if (RING_LOAD(&(r->head)) != RING_LOAD(&(r->tail)))
+    return 1;
+
+  if (RING_LOAD(&(r->done)) && RING_LOAD(&(r->head)) == RING_LOAD(&(r->tail)))
+    rb_raise(eError, "%s", r->error[0] ? r->error : "FAM reader thread stopped");
+
+  return 0;
+}
+
+/*
+ * Shift the next raw event from the ring, and store the time the
+ * reader read it in received.  Returns 0 if the ring is empty.
+ */
+static int reader_shift(Reader *r, FAMEvent *fe, double *received)
+{
+  size_t head, tail;
+  RingEv e, *slot;
+
+  do {
+    head = RING_LOAD(&(r->head));
+    if (head == (tail = RING_LOAD(&(r->tail))))
+      return 0;
+
+    /* the reader may discard this slot and reuse it under our feet, so
+     * only trust the copy if the claim succeeds */
+    slot = r->slots + (head & r->mask);
+    e.code = RING_PEEK(&(slot->code));
+    e.reqnum = RING_PEEK(&(slot->reqnum));
+    e.userdata = RING_PEEK(&(slot->userdata));
+    e.filename = RING_PEEK(&(slot->filename));
+    e.received = *(volatile double*) &(slot->received);
+  } while (!RING_CAS(&(r->head), head, head + 1));
+
+  fe->fc = NULL;
+  fe->hostname = NULL;
+  fe->code = e.code;
+  FAMREQUEST_GETREQNUM(&(fe->fr)) = e.reqnum;
+  fe->userdata = e.userdata;
+  *received = e.received;
+  strncpy(fe->filename, e.filename, sizeof(fe->filename) - 1);
+  fe->filename[sizeof(fe->filename) - 1] = '\0';
+  free(e.filename);
+
+  if (e.code == FAMOverflow && !e.userdata)
+    RING_STORE(&(r->overflow_queued), 0);
+
+  /* the ring was full, so the reader may be waiting for room; reload
+   * the tail, since the reader may have filled the ring after we read
+   * it above */
+  if (RING_LOAD(&(r->tail)) - head > r->mask) {
+    if (r->policy == OVERFLOW_BLOCK) {
+      pthread_mutex_lock(&(r->lock));
+      pthread_cond_signal(&(r->space));
+      pthread_mutex_unlock(&(r->lock));
+    } else {
+      pipe_poke(r->wake[1]);
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Clear pending wakeups before waiting; callers must check the ring
+ * again afterwards.
+ */
+static void reader_clear(Reader *r)
+{
+  pipe_clear(r->notify[0]);
+}
+#else
+#define conn_lock(conn)
+#define conn_unlock(conn)
+#define reader_stop(conn)
+#endif /* USE_READER */
+
+static int backend_monitor(FamConn *conn, const char *path, FAMRequest *req,
+                           void *userdata, int is_dir)
+{
+  int ret;
+
+  conn_lock(conn);
+  ret = BACKEND_CALL(conn, is_dir ?
+    FAMMonitorDirectory(&(conn->fc), path, req, userdata) :
+    FAMMonitorFile(&(conn->fc), path, req, userdata),
+    ino_monitor(&(conn->ino), path, req, userdata, is_dir));
+  conn_unlock(conn);
+  FAM_PROBE4(monitor_add, path, FAMREQUEST_GETREQNUM(req), is_dir, ret);
+
+  return ret;
+}
+
+static int backend_cancel(FamConn *conn, FAMRequest *req)
+{
+  int ret;
+
+  conn_lock(conn);
+  ret = BACKEND_CALL(conn, FAMCancelMonitor(&(conn->fc), req),
+                     ino_cancel(&(conn->ino), req));
+  conn_unlock(conn);
+  FAM_PROBE2(monitor_cancel, FAMREQUEST_GETREQNUM(req), ret);
+
+  return ret;
+}
+
+static int backend_close(FamConn *conn)
+{
+  reader_stop(conn);
+  conn->open = 0;
+#ifdef USE_INOTIFY
+  if (conn->backend == BACKEND_INOTIFY) {
+    ino_close(&(conn->ino));
+    return 0;
+  }
+#endif /* USE_INOTIFY */
+  return FAMClose(&(conn->fc));
+}
+
+/*****************/
+/* REQUEST TABLE */
+/*****************/
+
+static void conn_add_req(FamConn *conn, FamReq *rec)
+{
+  conn->stats.requests++;
+  conn->stats.live++;
+  rec->conn = conn;
+  rec->prev = NULL;
+  if ((rec->next = conn->reqs))
+    rec->next->prev = rec;
+  conn->reqs = rec;
+}
+
+static void conn_forget_req(FamConn *conn, FamReq *rec)
+{
+  if (!rec->conn)
+    return;
+
+  if (rec->prev)
+    rec->prev->next = rec->next;
+  else
+    conn->reqs = rec->next;
+  if (rec->next)
+    rec->next->prev = rec->prev;
+
+  rec->conn = NULL;
+  rec->prev = rec->next = NULL;
+  conn->stats.live--;
+  if (conn->mv.count)
+    mv_forget(&(conn->mv), rec);
+
+  /* no more events will be fingerprinted; don't keep the cache around
+   * for as long as the Fam::Request object lives */
+  if (rec->fp) {
+    fp_free(rec->fp);
+    rec->fp = NULL;
+  }
+}
+
+static void conn_forget_reqs(FamConn *conn)
+{
+  while (conn->reqs)
+    conn_forget_req(conn, conn->reqs);
+}
+
+/*****************/
+/* TREE MONITORS */
+/*****************/
+
+/*
+ * A tree monitor is a set of directory monitors, one per directory,
+ * that share a single request number.  Each node is passed to the
+ * backend as the monitor's user data, so events map back to their node
+ * with a pointer dereference.  Nodes stay allocated until the backend
+ * acknowledges their cancellation, since events may still refer to
+ * them until then.
+ */
+typedef struct TreeNode {
+  ReqHead head;
+  struct Tree *tree;
+  struct TreeNode *parent;
+  struct TreeNode *children;        /* first child */
+  struct TreeNode *prev, *next;     /* siblings */
+  struct TreeNode *all_prev, *all_next;
+  FAMRequest req;
+  int depth;
+  int is_new;       /* created after the initial scan */
+  int cancelled;
+  char *path;       /* full path */
+  const char *rel;  /* path relative to the tree root ("" for the root) */
+  const char *name; /* last path component */
+} TreeNode;
+
+typedef struct Tree {
+  struct Tree *next;  /* next tree on this connection */
+  FamReq *rec;        /* request reported for the tree */
+  TreeNode *root;
+  TreeNode *all;      /* every node, including cancelled ones */
+  long nodes;
+  int reqnum;
+  int max_depth;      /* -1 for unlimited */
+} Tree;
+
+/*
+ * Create a node for the directory name in parent (or the root
+ * directory, if parent is NULL) and start monitoring it.  Returns NULL
+ * and sets errno on failure.
+ */
+static TreeNode *tree_add(FamConn *conn, Tree *tree, TreeNode *parent,
+                          const char *name, int is_new)
+{
+  TreeNode *node;
+  size_t len;
+
+  if (!(node = calloc(1, sizeof(TreeNode))))
+    return NULL;
+
+  if (parent) {
+    len = strlen(parent->path) + 1 + strlen(name) + 1;
+    if ((node->path = malloc(len)))
+      snprintf(node->path, len, "%s/%s", parent->path, name);
+  } else {
+    node->path = strdup(name);
+  }
+
+  if (!node->path) {
+    free(node);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  node->head.type = REQ_TREE_NODE;
+  node->tree = tree;
+  node->is_new = is_new;
+  if (parent) {
+    node->depth = parent->depth + 1;
+    node->name = node->path + strlen(parent->path) + 1;
+    node->rel = node->path + strlen(tree->root->path) + 1;
+  } else {
+    node->name = node->path;
+    node->rel = node->path + strlen(node->path);
+  }
+
+  if (backend_monitor(conn, node->path, &(node->req), node, 1) == -1) {
+    free(node->path);
+    free(node);
+    return NULL;
+  }
+
+  if ((node->parent = parent)) {
+    if ((node->next = parent->children))
+      node->next->prev = node;
+    parent->children = node;
+  }
+
+  if ((node->all_next = tree->all))
+    node->all_next->all_prev = node;
+  tree->all = node;
+  tree->nodes++;
+
+  return node;
+}
+
+/*
+ * Release a node whose cancellation has been acknowledged (or every
+ * node, once the connection is closed).  Frees the tree too once its
+ * last node is gone; returns 1 if it did.
+ */
+static int tree_free_node(FamConn *conn, TreeNode *node)
+{
+  Tree *tree = node->tree, **tp;
+  TreeNode *child;
+
+  for (child = node->children; child; child = child->next)
+    child->parent = NULL;
+
+  if (node->prev)
+    node->prev->next = node->next;
+  else if (node->parent)
+    node->parent->children = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+
+  if (node->all_prev)
+    node->all_prev->all_next = node->all_next;
+  else
+    tree->all = node->all_next;
+  if (node->all_next)
+    node->all_next->all_prev = node->all_prev;
+
+  if (tree->root == node)
+    tree->root = NULL;
+
+  free(node->path);
+  free(node);
+
+  if (--tree->nodes > 0)
+    return 0;
+
+  for (tp = &(conn->trees); *tp; tp = &((*tp)->next)) {
+    if (*tp == tree) {
+      *tp = tree->next;
+      break;
+    }
+  }
+
+  if (tree->rec) {
+    tree->rec->tree = NULL;
+    conn_forget_req(conn, tree->rec);
+  }
+
+  free(tree);
+  return 1;
+}
+
+/* called when the tree's Fam::Request is freed first */
+static void tree_detach(Tree *tree)
+{
+  tree->rec = NULL;
+}
+
+/* cancel a node and everything below it */
+static void tree_cancel_node(FamConn *conn, TreeNode *node)
+{
+  TreeNode *child;
+
+  if (node->cancelled)
+    return;
+
+  node->cancelled = 1;
+  for (child = node->children; child; child = child->next)
+    tree_cancel_node(conn, child);
+
+  backend_cancel(conn, &(node->req));
+}
+
+/*
+ * Add nodes for every directory below node.  fd is an open descriptor
+ * for the node's directory; it is closed before returning.  Directories
+ * which vanish or can't be read during the walk are skipped.
+ */
+static void tree_walk(FamConn *conn, Tree *tree, TreeNode *node, int fd)
+{
+  struct dirent *de;
+  DIR *dir;
+
+  if ((tree->max_depth >= 0 && node->depth >= tree->max_depth) ||
+      !(dir = fdopendir(fd))) {
+    close(fd);
+    return;
+  }
+
+  while ((de = readdir(dir))) {
+    TreeNode *child;
+    int is_dir, cfd;
+
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+
+#ifdef DT_DIR
+    if (de->d_type != DT_UNKNOWN) {
+      is_dir = (de->d_type == DT_DIR);
+    } else
+#endif /* DT_DIR */
+    {
+      struct stat st;
+      is_dir = !fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+               S_ISDIR(st.st_mode);
+    }
+
+    /* watch the directory before reading it, so nothing slips by */
+    if (!is_dir || !(child = tree_add(conn, tree, node, de->d_name, node->is_new)))
+      continue;
+
+    cfd = openat(dirfd(dir), de->d_name,
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (cfd != -1)
+      tree_walk(conn, tree, child, cfd);
+  }
+
+  closedir(dir);
+}
+
+/* start monitoring a directory created below node */
+static void tree_created(FamConn *conn, TreeNode *node, const char *name)
+{
+  Tree *tree = node->tree;
+  TreeNode *child;
+  struct stat st;
+  char path[PATH_MAX];
+  int fd;
+
+  if (tree->max_depth >= 0 && node->depth >= tree->max_depth)
+    return;
+
+  for (child = node->children; child; child = child->next)
+    if (!child->cancelled && !strcmp(child->name, name))
+      return;
+
+  if (snprintf(path, sizeof(path), "%s/%s", node->path, name) >= (int) sizeof(path) ||
+      lstat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+    return;
+
+  if (!(child = tree_add(conn, tree, node, name, 1)))
+    return;
+
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) != -1)
+    tree_walk(conn, tree, child, fd);
+}
+
+/*
+ * Translate an event for a tree node into an event for the tree: the
+ * request number becomes the tree's, filenames become relative to the
+ * tree root, and new subdirectories are monitored before their CREATED
+ * event is reported.  Returns 0 if the event should be dropped.
+ */
+static int tree_process(FamConn *conn, TreeNode *node, FAMEvent *ev)
+{
+  Tree *tree = node->tree;
+  char buf[PATH_MAX];
+
+  FAMREQUEST_GETREQNUM(&(ev->fr)) = tree->reqnum;
+  ev->userdata = tree->rec;
+
+  /* lost events: name the directory which needs a rescan */
+  if (ev->code == FAMOverflow) {
+    snprintf(ev->filename, sizeof(ev->filename), "%s",
+             *(node->rel) ? node->rel : ".");
+    return !node->cancelled;
+  }
+
+  if (ev->code == FAMAcknowledge) {
+    int is_root = (node == tree->root);
+
+    tree_free_node(conn, node);
+    return is_root;
+  }
+
+  if (node->cancelled)
+    return 0;
+
+  if (!strcmp(ev->filename, node->path)) {
+    /* event for the directory itself; the parent reports those */
+    if (node == tree->root)
+      return 1;
+    if (ev->code == FAMDeleted)
+      tree_cancel_node(conn, node);
+    return 0;
+  }
+
+  if (ev->code == FAMEndExist)
+    return node == tree->root;
+
+  /* entries in new directories are new too */
+  if (ev->code == FAMExists && node->is_new)
+    ev->code = FAMCreated;
+
+  if (ev->code == FAMCreated)
+    tree_created(conn, node, ev->filename);
+
+  if (*(node->rel)) {
+    if (snprintf(buf, sizeof(buf), "%s/%s", node->rel, ev->filename) >= (int) sizeof(buf))
+      return 0;
+    memcpy(ev->filename, buf, strlen(buf) + 1);
+  }
+
+  return 1;
+}
+
+/* cancel every monitor in a tree */
+static void tree_cancel(FamConn *conn, Tree *tree)
+{
+  TreeNode *node;
+
+  for (node = tree->all; node; node = node->all_next)
+    tree_cancel_node(conn, node);
+}
+
+/* release every tree on a connection (after it has been closed) */
+static void tree_free_all(FamConn *conn)
+{
+  while (conn->trees)
+    while (!tree_free_node(conn, conn->trees->all))
+      ;
+}
+
+/**********************/
+/* CONNECTION METHODS */
+/**********************/
+static void fam_conn_mark(void *ptr)
+{
+  FamConn *conn = ptr;
+  FamReq *rec;
+
+  for (rec = conn->reqs; rec; rec = rec->next)
+    rb_gc_mark(rec->self);
+  co_mark(&(conn->co));
+  rb_gc_mark(conn->meta.from);
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  rb_gc_mark(conn->io);
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+}
+
+static void fam_conn_free(void *ptr)
+{
+  FamConn *conn = ptr;
+
+  if (conn->open)
+    backend_close(conn);
+  mv_clear(&(conn->mv));
+  tree_free_all(conn);
+  conn_forget_reqs(conn);
+  co_free(&(conn->co));
+  free(conn->latency);
+  xfree(conn);
+}
+
+static size_t fam_conn_memsize(const void *ptr)
+{
+  const FamConn *conn = ptr;
+  size_t ret = sizeof(FamConn) + conn->co.len * sizeof(CoEv) +
+               conn->mv.count * sizeof(MvEnt);
+
+  if (conn->latency)
+    ret += sizeof(Hist);
+#ifdef USE_READER
+  if (conn->reader)
+    ret += sizeof(Reader) + (conn->reader->mask + 1) * sizeof(RingEv);
+#endif /* USE_READER */
+  return ret;
+}
+
+static const rb_data_type_t fam_conn_type = {
+  "Fam::Connection",
+  { fam_conn_mark, fam_conn_free, fam_conn_memsize, },
+};
+
+static VALUE fam_conn_s_alloc(VALUE klass)
+{
+  FamConn *conn = ALLOC(FamConn);
+  memset(conn, 0, sizeof(FamConn));
+  return TypedData_Wrap_Struct(klass, &fam_conn_type, conn);
+}
+
+/*
+ * Get the connection wrapped by a Fam::Connection object, raising a
+ * Fam::Error exception if it has been closed.
+ */
+static FamConn *get_conn(VALUE self)
+{
+  FamConn *conn;
+
+  TypedData_Get_Struct(self, FamConn, &fam_conn_type, conn);
+  if (!conn->open)
+    rb_raise(eError, "FAM connection is closed");
+
+  return conn;
+}
+
+/*
+ * Get the connection wrapped by a Fam::Connection object, raising a
+ * Fam::Error exception unless it uses the FAM backend.
+ */
+static FamConn *get_fam_conn(VALUE self, const char *what)
+{
+  FamConn *conn = get_conn(self);
+
+  if (conn->backend != BACKEND_FAM)
+    rb_raise(eError, "Couldn't %s: not supported by the inotify backend", what);
+
+  return conn;
+}
+
+/*
+ * Get the request record wrapped by a Fam::Request object, raising an
+ * ArgumentError exception if the request was made on another
+ * connection, or a Fam::Error exception if it has been cancelled or
+ * its connection closed.  The request number of a finished request may
+ * already belong to a newer one, so it is never passed to the backend.
+ */
+static FamReq *conn_req(FamConn *conn, VALUE request)
+{
+  FamReq *rec = get_req(request);
+
+  if (rec->conn && rec->conn != conn)
+    rb_raise(rb_eArgError, "monitor request %d belongs to another connection",
+             FAMREQUEST_GETREQNUM(&(rec->req)));
+  if (rec->cancelled)
+    rb_raise(eError, "monitor request %d is already cancelled",
+             FAMREQUEST_GETREQNUM(&(rec->req)));
+  if (!rec->conn)
+    rb_raise(eError, "monitor request %d is no longer active",
+             FAMREQUEST_GETREQNUM(&(rec->req)));
+
+  return rec;
+}
+
+#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
+/*
+ * Create a new connection to the FAM daemon.
+ *
+ * Examples:
+ *   # connect and tell FAM the application is named 'foo'
+ *   fam = Fam::Connection.new 'foo'
+ *
+ *   # just connect
+ *   fam = Fam::Connection.new
+ *
+ */
+static VALUE fam_conn_s_new(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE self = fam_conn_s_alloc(klass);
+
+  rb_obj_call_init(self, argc, argv);
+  return self;
+}
+#endif
+
+static VALUE conn_close(VALUE self)
+{
+  return rb_funcall(self, rb_intern("close"), 0, 0);
+}
+
+/*
+ * Create a new connection to the FAM daemon.
+ *
+ * Aliases:
+ *   Fam::Connection.open2
+ *
+ * Examples:
+ *   # connect and tell FAM the application is named 'foo'
+ *   fam = Fam::Connection.open 'foo'
+ *
+ *   # just connect
+ *   fam = Fam::Connection.open
+ *
+ *   # connect and close automatically
+ *   Fam::Connection.open('foo') {|fam| ... }
+ *
+ */
+static VALUE
+fam_conn_s_open(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE self = rb_class_new_instance(argc, argv, klass);
+
+  if (rb_block_given_p()) {
+    return rb_ensure(rb_yield, self, conn_close, self);
+  }
+
+  return self;
+}
+
+/*
+ * Create a new connection to the FAM daemon.
+ *
+ * The optional :backend option selects where events come from:
+ * :fam (the default) talks to the FAM or Gamin daemon, and :inotify
+ * (Linux only) watches files directly with inotify, without a daemon.
+ * The inotify backend supports monitor_file, monitor_directory,
+ * cancel_monitor and no_exists, and generates the same event codes as
+ * FAM (including EXISTS, END_EXIST and ACKNOWLEDGE).  Unlike FAM, it
+ * can't monitor paths that don't exist yet.
+ *
+ * The optional :reader option starts a native thread which reads
+ * events from the backend as soon as they arrive, into a ring of the
+ * given size (4096 events if true).  This keeps the daemon (or kernel)
+ * queue from filling up while Ruby is busy with a GC pause or a long
+ * request; next_event and friends then read from the ring.  When the
+ * ring is full, the thread stops reading until there is room.  In
+ * reader mode, Fam::Connection#fd returns a descriptor which becomes
+ * readable when the ring has events.
+ *
+ * The optional :overflow option selects what the reader thread does
+ * when the ring is full:
+ *   :block        stop reading until there is room (the default)
+ *   :drop_oldest  drop the oldest queued events to make room
+ *   :drop_newest  drop incoming events
+ *   :rescan       drop incoming events, and deliver one OVERFLOW
+ *                 event per affected request instead of its later
+ *                 events, so the request can be rescanned
+ * Whenever events are dropped, an OVERFLOW event (see
+ * Fam::Event::OVERFLOW) is delivered once there is room again; its
+ * request is nil unless the policy is :rescan.  ACKNOWLEDGE events are
+ * never dropped.  The inotify backend also delivers an OVERFLOW event
+ * when the kernel queue overflows.
+ *
+ * Raises an ArgumentError exception if the number of arguments is not 0
+ * or 1, the backend or overflow policy is unknown, an overflow policy
+ * is given without :reader, or the reader size isn't positive, or a
+ * Fam::Error exception if a connection to FAM could not be
+ * established or the reader thread could not be started.
+ *
+ * Examples:
+ *   # connect and tell FAM the application is named 'foo'
+ *   fam = Fam::Connection.new 'foo'
+ *
+ *   # just connect
+ *   fam = Fam::Connection.new
+ *
+ *   # use inotify instead of the FAM daemon
+ *   fam = Fam::Connection.new 'foo', :backend => :inotify
+ *
+ *   # read events in the background
+ *   fam = Fam::Connection.new 'foo', :reader => 16384
+ *
+ *   # never stall the daemon; rescan whatever fell behind
+ *   fam = Fam::Connection.new 'foo', :reader => 16384, :overflow => :rescan
+ *
+ */
+static VALUE fam_conn_init(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn;
+  VALUE backend = Qnil, reader = Qnil, overflow = Qnil;
+  long reader_size = 0;
+  int err = 0, policy;
+
+  TypedData_Get_Struct(self, FamConn, &fam_conn_type, conn);
+  if (conn->open)
+    rb_raise(eError, "FAM connection is already open");
+
+  if (argc > 0 && TYPE(argv[argc - 1]) == T_HASH) {
+    backend = rb_hash_aref(argv[argc - 1], ID2SYM(rb_intern("backend")));
+    overflow = rb_hash_aref(argv[argc - 1], ID2SYM(rb_intern("overflow")));
+    reader = rb_hash_aref(argv[--argc], ID2SYM(rb_intern("reader")));
+  }
+
+  if (NIL_P(overflow) || overflow == ID2SYM(rb_intern("block")))
+    policy = OVERFLOW_BLOCK;
+  else if (overflow == ID2SYM(rb_intern("drop_oldest")))
+    policy = OVERFLOW_DROP_OLDEST;
+  else if (overflow == ID2SYM(rb_intern("drop_newest")))
+    policy = OVERFLOW_DROP_NEWEST;
+  else if (overflow == ID2SYM(rb_intern("rescan")))
+    policy = OVERFLOW_RESCAN;
+  else
+    rb_raise(rb_eArgError, "unknown overflow policy (not :block, "
+             ":drop_oldest, :drop_newest or :rescan)");
+
+  if (reader == Qtrue)
+    reader_size = READER_DEFAULT_SIZE;
+  else if (RTEST(reader) && (reader_size = NUM2LONG(reader)) < 1)
+    rb_raise(rb_eArgError, "invalid reader size (not positive)");
+  if (policy != OVERFLOW_BLOCK && !reader_size)
+    rb_raise(rb_eArgError, "overflow policies require the :reader option");
+
+  if (NIL_P(backend) || backend == ID2SYM(rb_intern("fam")))
+    conn->backend = BACKEND_FAM;
+  else if (backend == ID2SYM(rb_intern("inotify")))
+    conn->backend = BACKEND_INOTIFY;
+  else
+    rb_raise(rb_eArgError, "unknown backend (not :fam or :inotify)");
+
+  if (argc > 1)
+    rb_raise(rb_eArgError, "invalid argument count (not 0 or 1)");
+
+  if (conn->backend == BACKEND_INOTIFY) {
+#ifdef USE_INOTIFY
+    if ((err = ino_open(&(conn->ino))) == -1) {
+      conn->err = errno;
+      ino_close(&(conn->ino));
+    }
+#else
+    rb_raise(eError, "Couldn't open FAM connection: "
+             "inotify backend not supported on this platform");
+#endif /* USE_INOTIFY */
+  } else if (argc == 1) {
+    err = FAMOpen2(&(conn->fc), StringValuePtr(argv[0]));
+  } else {
+    err = FAMOpen(&(conn->fc));
+  }
+  
+  if (err == -1) {
+    rb_raise(eError, "Couldn't open FAM connection: %s", backend_error(conn));
+  }
+
+  conn->open = 1;
+
+  if (reader_size) {
+#ifdef USE_READER
+    if (reader_start(conn, reader_size, policy) == -1) {
+      err = errno;
+      backend_close(conn);
+      rb_raise(eError, "Couldn't start FAM reader thread: %s", strerror(err));
+    }
+#else
+    backend_close(conn);
+    rb_raise(eError, "Couldn't start FAM reader thread: "
+             "threads not supported on this platform");
+#endif /* USE_READER */
+  }
+
+  return self;
+}
+
+/*
+ * Return the backend of a Fam::Connection object (:fam or :inotify).
+ *
+ * Examples:
+ *   puts 'no daemon needed' if fam.backend == :inotify
+ *
+ */
+static VALUE fam_conn_backend(VALUE self)
+{
+  FamConn *conn;
+
+  TypedData_Get_Struct(self, FamConn, &fam_conn_type, conn);
+  return ID2SYM(rb_intern(conn->backend == BACKEND_INOTIFY ? "inotify" : "fam"));
+}
+
+/*
+ * Close a Fam::Connection.
+ *
+ * Raises a Fam::Error exception if the connection to FAM could not
+ * be closed.
+ *
+ * Examples:
+ *   fam.close
+ *
+ */
+  
+/* this causes a segfault, since ruby attempts to close the connection
+ * when it goes out of scope.  We'll let ruby take care of it. :) */
+static VALUE fam_conn_close(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+  int err;
+
+  err = backend_close(conn);
+  mv_clear(&(conn->mv));
+  tree_free_all(conn);
+  conn_forget_reqs(conn);
+  co_free(&(conn->co));
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  conn->io = Qfalse;
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't close FAM connection: %s", backend_error(conn));
+  }
+  
+  return self;
+}
+
+#ifndef HAVE_RB_STAT_NEW
+static VALUE snapshot_lstat(VALUE path)
+{
+  return rb_funcall(rb_cFile, rb_intern("lstat"), 1, path);
+}
+
+static VALUE snapshot_lstat_failed(VALUE arg, VALUE err)
+{
+  return Qnil;
+}
+#endif /* !HAVE_RB_STAT_NEW */
+
+/*
+ * List a directory natively, for snapshot monitors.  Returns an array
+ * of entry names, or a hash of entry names to File::Stat objects (nil
+ * for entries which vanished) if with_stat is set, or nil if the
+ * directory couldn't be read.
+ */
+static VALUE dir_snapshot(const char *path, int with_stat)
+{
+  VALUE ret = rb_ary_new(), hash, name;
+  struct dirent *de;
+#ifdef HAVE_RB_STAT_NEW
+  struct stat st;
+#endif /* HAVE_RB_STAT_NEW */
+  DIR *dir;
+  long i;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    return Qnil;
+  if (!(dir = fdopendir(fd))) {
+    close(fd);
+    return Qnil;
+  }
+
+  while ((de = readdir(dir)))
+    if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+      rb_ary_push(ret, rb_str_new2(de->d_name));
+
+  if (!with_stat) {
+    closedir(dir);
+    return ret;
+  }
+
+  hash = rb_hash_new();
+  for (i = 0; i < RARRAY_LEN(ret); i++) {
+    name = rb_ary_entry(ret, i);
+#ifdef HAVE_RB_STAT_NEW
+    rb_hash_aset(hash, name,
+                 fstatat(fd, RSTRING_PTR(name), &st, AT_SYMLINK_NOFOLLOW) ?
+                 Qnil : rb_stat_new(&st));
+#else
+    rb_hash_aset(hash, name, rb_rescue2(snapshot_lstat,
+                 rb_str_cat2(rb_str_cat2(rb_str_new2(path), "/"), RSTRING_PTR(name)),
+                 snapshot_lstat_failed, Qnil, rb_eSystemCallError, 0));
+#endif /* HAVE_RB_STAT_NEW */
+  }
+
+  closedir(dir);
+  return hash;
+}
+
+/*
+ * Monitor a directory.
+ *
+ * Returns a Fam::Request object, which is used to identify the monitor
+ * associated with events.
+ *
+ * Options:
+ *   :context  arbitrary object returned by Fam::Event#context for
+ *             events from this monitor
+ *   :codes    event code (or array of codes) to deliver; other
+ *             events are dropped
+ *   :include  glob pattern (or array of patterns); only events for
+ *             matching files are delivered
+ *   :exclude  glob pattern (or array of patterns); events for
+ *             matching files are dropped
+ *   :snapshot if true, list the directory natively instead of
+ *             delivering EXISTS and END_EXIST events, and store the
+ *             entry names in Fam::Request#snapshot; if :stat, store a
+ *             hash of entry names to File::Stat objects instead
+ *   :state    if true, keep the set of directory entries up to date
+ *             as events are read, in a Fam::DirState object
+ *             (Fam::Request#state); if :stat, keep each entry's size,
+ *             mtime and inode as well
+ *   :fingerprint
+ *             if true or :stat, drop CHANGED events for entries whose
+ *             inode, size and mtime haven't changed; if :content, also
+ *             hash regular files of up to 1 MiB and flag CHANGED events
+ *             that left the contents alone (Fam::Event#metadata_only?)
+ *
+ * Filters are evaluated in C as events are read, so dropped events
+ * cost no Ruby objects.  Patterns without a slash are matched against
+ * the last component of the event filename; patterns with one are
+ * matched against the whole filename, and wildcards don't match
+ * slashes.  Leading dots must be matched explicitly.  ACKNOWLEDGE and
+ * END_EXIST events are only subject to :codes.
+ *
+ * Snapshots are much cheaper than EXISTS events for large directories,
+ * since entries don't cross the FAM socket one event at a time.  The
+ * listing is taken after the monitor is registered, so nothing is
+ * missed, although an entry created in between may appear both in the
+ * snapshot and in a CREATED event.  Under Gamin, use
+ * Fam::Connection#no_exists as well to stop the daemon sending the
+ * EXISTS events at all; otherwise they are dropped as they're read.
+ *
+ * The directory state is updated from every event as it is read,
+ * whether or not the event is delivered, so lookups are hash lookups
+ * instead of scans over a list of names kept in Ruby.  Entries are
+ * added by EXISTS and CREATED events (and CHANGED events for unknown
+ * entries), and removed by DELETED events.  With :snapshot, the state
+ * starts from the native listing instead.
+ *
+ * Fingerprints suppress the CHANGED events sent for attribute-only
+ * changes (chmod, chown, atime updates), which otherwise cost a
+ * rebuild or a reload apiece.  Each entry is stat'ed (and with
+ * :content, read) as its EXISTS, CREATED and CHANGED events arrive, so
+ * the first CHANGED event for an entry that was never listed, such as
+ * after :snapshot or Fam::Connection#no_exists, is always delivered.
+ * Files whose events the filters drop anyway aren't fingerprinted, and
+ * with :codes, contents are only hashed if CHANGED events are wanted.
+ * Dropped events are counted in Fam::Connection#stats as :unchanged.
+ *
+ * Raises a Fam::Error exception if the directory could not be
+ * monitored, or an ArgumentError exception if a filter is invalid.
+ *
+ * Aliases:
+ *   Fam::Connection#monitor_dir
+ *   Fam::Connection#directory
+ *   Fam::Connection#dir
+ *
+ * Examples:
+ *   req = fam.monitor_directory '/tmp'
+ *   req = fam.monitor_directory '/tmp', :context => tmp_handler
+ *
+ *   # initial state without an EXISTS flood
+ *   req = fam.monitor_directory '/var/spool', :snapshot => true
+ *   queue = req.snapshot
+ *
+ *   # query the directory instead of tracking events
+ *   req = fam.monitor_directory '/var/spool', :state => true
+ *   fam.drain
+ *   puts "#{req.state.size} files" if req.state.include?('lock')
+ *
+ *   # ignore chmod and touch
+ *   req = fam.monitor_directory 'conf', :fingerprint => :content
+ *   while ev = fam.next_event
+ *     reload(ev.file) unless ev.metadata_only?
+ *   end
+ *
+ *   # only changes to ruby files, ignoring editor droppings
+ *   req = fam.monitor_directory 'lib', :include => '*.rb',
+ *                               :exclude => ['*.swp', '*~'],
+ *                               :codes => [Fam::Event::CHANGED,
+ *                                          Fam::Event::CREATED]
+ *
+ */
+static VALUE fam_conn_dir(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn = get_conn(self);
+  VALUE dir, opts, ret, snapshot = Qnil, state = Qnil;
+  FamReq *rec;
+  int err, mode;
+#ifdef USE_INOTIFY
+  int no_exists;
+#endif /* USE_INOTIFY */
+
+  rb_scan_args(argc, argv, "11", &dir, &opts);
+  StringValue(dir);
+
+  ret = new_req(REQ_MONITOR, get_context(opts), &rec);
+  rec->filter = get_filter(opts, NULL);
+  req_set_path(rec, StringValueCStr(dir));
+  if ((mode = get_fp_mode(opts)))
+    rec->fp = fp_new(rec->path, mode, 1);
+  if (!NIL_P(opts)) {
+    snapshot = rb_hash_aref(opts, ID2SYM(rb_intern("snapshot")));
+    state = rb_hash_aref(opts, ID2SYM(rb_intern("state")));
+  }
+  rec->skip_exists = RTEST(snapshot);
+  if (RTEST(state))
+    rec->state = ds_new(StringValueCStr(dir),
+                        state == ID2SYM(rb_intern("stat")));
+
+#ifdef USE_INOTIFY
+  /* don't bother synthesizing the EXISTS events we'd drop anyway */
+  no_exists = conn->ino.no_exists;
+  conn->ino.no_exists |= rec->skip_exists;
+  err = backend_monitor(conn, RSTRING_PTR(dir), &(rec->req), rec, 1);
+  conn->ino.no_exists = no_exists;
+#else
+  err = backend_monitor(conn, RSTRING_PTR(dir), &(rec->req), rec, 1);
+#endif /* USE_INOTIFY */
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't monitor directory \"%s\": %s",
+             RSTRING_PTR(dir) ? RSTRING_PTR(dir) : "NULL", backend_error(conn));
+  }
+
+  conn_add_req(conn, rec);
+
+  if (rec->skip_exists) {
+    rec->snapshot = dir_snapshot(StringValueCStr(dir),
+                                 snapshot == ID2SYM(rb_intern("stat")));
+    if (!NIL_P(rec->state))
+      ds_scan(get_ds(rec->state));
+  }
+  return ret;
+}
+
+/*
+ * Monitor a file.
+ *
+ * Returns a Fam::Request object, which is used to identify the monitor
+ * associated with events.
+ *
+ * Options:
+ *   :context  arbitrary object returned by Fam::Event#context for
+ *             events from this monitor
+ *   :codes, :include, :exclude
+ *             event filters; see Fam::Connection#monitor_directory
+ *   :fingerprint
+ *             true, :stat or :content, to suppress attribute-only
+ *             CHANGED events; see Fam::Connection#monitor_directory
+ *
+ * Raises a Fam::Error exception if the file could not be monitored,
+ * or an ArgumentError exception if an option is invalid.
+ *
+ * Aliases:
+ *   Fam::Connection#file
+ *
+ * Examples:
+ *   req = fam.monitor_file '/var/log/messages'
+ *   req = fam.monitor_file '/var/log/messages', :context => log_handler
+ *
+ */
+static VALUE fam_conn_file(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn = get_conn(self);
+  VALUE file, opts, ret;
+  FamReq *rec;
+  int err, mode;
+
+  rb_scan_args(argc, argv, "11", &file, &opts);
+  StringValue(file);
+
+  ret = new_req(REQ_MONITOR, get_context(opts), &rec);
+  rec->filter = get_filter(opts, NULL);
+  if ((mode = get_fp_mode(opts)))
+    rec->fp = fp_new(StringValueCStr(file), mode, 0);
+  err = backend_monitor(conn, RSTRING_PTR(file), &(rec->req), rec, 0);
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't monitor file \"%s\": %s",
+             RSTRING_PTR(file) ? RSTRING_PTR(file) : "NULL", backend_error(conn));
+  }
+
+  conn_add_req(conn, rec);
+  return ret;
+}
+
+/*
+ * Monitor each path in an array of paths.  Shared by
+ * Fam::Connection#monitor_files and Fam::Connection#monitor_directories.
+ */
+static VALUE conn_monitor_all(int argc, VALUE *argv, VALUE self, int is_dir)
+{
+  FamConn *conn = get_conn(self);
+  VALUE paths, opts, context, reqs, errs, path, all;
+  VALUE snapshot = Qnil, state = Qnil;
+  FamFilter *filter;
+  FamReq *rec;
+  long i, num;
+  int err, mode;
+#ifdef USE_INOTIFY
+  int no_exists;
+#endif /* USE_INOTIFY */
+
+  rb_scan_args(argc, argv, "11", &paths, &opts);
+  paths = rb_check_array_type(paths);
+  if (NIL_P(paths))
+    rb_raise(rb_eTypeError, "paths must be an array");
+  paths = rb_ary_dup(paths);
+
+  /* convert everything up front, so nothing below calls back into ruby */
+  num = RARRAY_LEN(paths);
+  for (i = 0; i < num; i++) {
+    path = rb_ary_entry(paths, i);
+    StringValueCStr(path);
+    rb_ary_store(paths, i, path);
+  }
+
+  context = get_context(opts);
+  mode = get_fp_mode(opts);
+  if (is_dir && !NIL_P(opts)) {
+    snapshot = rb_hash_aref(opts, ID2SYM(rb_intern("snapshot")));
+    state = rb_hash_aref(opts, ID2SYM(rb_intern("state")));
+  }
+  reqs = rb_ary_new2(num);
+  errs = rb_ary_new();
+  if (!num)
+    return rb_ary_new3(2, reqs, errs);
+
+  /* records are allocated separately, so each is freed with its own
+   * request rather than pinning a block for as long as any of them is
+   * alive; keep them all reachable until they're on the request list */
+  all = rb_ary_new2(num);
+  for (i = 0; i < num; i++)
+    rb_ary_push(all, new_req(REQ_MONITOR, context, &rec));
+
+  if ((filter = get_filter(opts, NULL)))
+    filter->refs = num;
+
+  for (i = 0; i < num; i++) {
+    rec = get_req(rb_ary_entry(all, i));
+    rec->filter = filter;
+    path = rb_ary_entry(paths, i);
+    if (mode)
+      rec->fp = fp_new(RSTRING_PTR(path), mode, is_dir);
+    if (is_dir) {
+      req_set_path(rec, RSTRING_PTR(path));
+      rec->skip_exists = RTEST(snapshot);
+      if (RTEST(state))
+        rec->state = ds_new(RSTRING_PTR(path),
+                            state == ID2SYM(rb_intern("stat")));
+    }
+
+#ifdef USE_INOTIFY
+    no_exists = conn->ino.no_exists;
+    conn->ino.no_exists |= rec->skip_exists;
+    err = backend_monitor(conn, RSTRING_PTR(path), &(rec->req), rec, is_dir);
+    conn->ino.no_exists = no_exists;
+#else
+    err = backend_monitor(conn, RSTRING_PTR(path), &(rec->req), rec, is_dir);
+#endif /* USE_INOTIFY */
+
+    if (err == -1) {
+      rb_ary_push(reqs, Qnil);
+      rb_ary_push(errs, rb_ary_new3(2, path, rb_str_new2(backend_error(conn))));
+      continue;
+    }
+
+    conn_add_req(conn, rec);
+    if (rec->skip_exists) {
+      rec->snapshot = dir_snapshot(RSTRING_PTR(path),
+                                   snapshot == ID2SYM(rb_intern("stat")));
+      if (!NIL_P(rec->state))
+        ds_scan(get_ds(rec->state));
+    }
+    rb_ary_push(reqs, rec->self);
+  }
+
+  RB_GC_GUARD(all);
+  return rb_ary_new3(2, reqs, errs);
+}
+
+/*
+ * Monitor an array of directories.
+ *
+ * This is much cheaper than calling Fam::Connection#monitor_directory
+ * in a loop: options are parsed once, the filter is shared by every
+ * request, and failures don't raise.  Returns an array of two
+ * arrays: the Fam::Request objects, in the same order as the paths
+ * (nil for paths which couldn't be monitored), and [path, message]
+ * pairs for the paths which couldn't be monitored.
+ *
+ * Accepts the same options as Fam::Connection#monitor_directory; they
+ * apply to every path, and each request keeps its own snapshot, state
+ * and fingerprints.
+ *
+ * Aliases:
+ *   Fam::Connection#monitor_dirs
+ *   Fam::Connection#directories
+ *   Fam::Connection#dirs
+ *
+ * Examples:
+ *   reqs, errs = fam.monitor_directories project_dirs
+ *   errs.each { |path, msg| warn "skipped #{path}: #{msg}" }
+ *
+ */
+static VALUE fam_conn_dirs(int argc, VALUE *argv, VALUE self)
+{
+  return conn_monitor_all(argc, argv, self, 1);
+}
+
+/*
+ * Monitor an array of files.
+ *
+ * See Fam::Connection#monitor_directories for the return value;
+ * accepts the same options as Fam::Connection#monitor_file.
+ *
+ * Aliases:
+ *   Fam::Connection#files
+ *
+ * Examples:
+ *   reqs, errs = fam.monitor_files %w{/etc/passwd /etc/group}
+ *
+ */
+static VALUE fam_conn_files(int argc, VALUE *argv, VALUE self)
+{
+  return conn_monitor_all(argc, argv, self, 0);
+}
+
+/*
+ * Monitor a directory and every directory below it.
+ *
+ * The whole tree is walked and monitored natively, and directories
+ * created later are monitored before their CREATED event is reported
+ * (the entries already inside them are reported as CREATED events as
+ * well).  Events for the tree all carry the request number of the
+ * returned Fam::Request, and filenames are relative to the tree root
+ * (events for the root directory itself carry its full path, as with
+ * monitor_directory).  Cancelling the returned request cancels the
+ * whole tree.  Note that EXISTS events for subdirectories may arrive
+ * after the END_EXIST event for the root.
+ *
+ * Symbolic links to directories are not followed, and directories
+ * which can't be read are skipped.
+ *
+ * Options:
+ *   :max_depth  maximum depth below the root to monitor (unlimited
+ *               if nil)
+ *   :context    arbitrary object returned by Fam::Event#context for
+ *               events from this tree
+ *   :codes, :include, :exclude
+ *               event filters; see Fam::Connection#monitor_directory.
+ *               Filtered events still update the tree itself.
+ *
+ * Raises a Fam::Error exception if the root directory could not be
+ * monitored.
+ *
+ * Aliases:
+ *   Fam::Connection#tree
+ *
+ * Examples:
+ *   req = fam.monitor_tree '/usr/src/linux'
+ *   req = fam.monitor_tree '/home', :max_depth => 2
+ *
+ */
+static VALUE fam_conn_tree(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn = get_conn(self);
+  VALUE path, opts, val, ret;
+  FamReq *rec;
+  Tree *tree;
+  int fd;
+
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  StringValue(path);
+  ret = new_req(REQ_TREE, get_context(opts), &rec);
+  rec->filter = get_filter(opts, NULL);
+
+  if (!(tree = calloc(1, sizeof(Tree))))
+    rb_memerror();
+  tree->max_depth = -1;
+
+  if (!NIL_P(opts)) {
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("max_depth")));
+    if (!NIL_P(val) && (tree->max_depth = NUM2INT(val)) < 0) {
+      free(tree);
+      rb_raise(rb_eArgError, "invalid maximum depth (negative)");
+    }
+  }
+
+  if (!(tree->root = tree_add(conn, tree, NULL, StringValueCStr(path), 0))) {
+    free(tree);
+    rb_raise(eError, "Couldn't monitor tree \"%s\": %s",
+             RSTRING_PTR(path), backend_error(conn));
+  }
+
+  tree->reqnum = FAMREQUEST_GETREQNUM(&(tree->root->req));
+  tree->next = conn->trees;
+  conn->trees = tree;
+
+  FAMREQUEST_GETREQNUM(&(rec->req)) = tree->reqnum;
+  req_set_path(rec, tree->root->path);
+  rec->tree = tree;
+  tree->rec = rec;
+  conn_add_req(conn, rec);
+
+  if ((fd = open(tree->root->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+    tree_walk(conn, tree, tree->root, fd);
+
+  return ret;
+}
+
+#ifdef HAVE_FAMMONITORCOLLECTION
+/*
+ * Monitor a collection.
+ *
+ * Only files matching mask are reported.  Gamin accepts collection
+ * monitors but ignores the depth and mask, so the mask is also applied
+ * to events as an :include filter.
+ *
+ * Options:
+ *   :context, :codes, :include, :exclude
+ *             see Fam::Connection#monitor_directory
+ *
+ * Raises a Fam::Error exception if the collection could not be
+ * monitored.
+ *
+ * Aliases:
+ *   Fam::Collection#monitor_col
+ *   Fam::Collection#col
+ *
+ * Examples:
+ *   req = fam.monitor_col 'download/images', 1, '*.jpg'
+ *
+ */
+static VALUE fam_conn_col(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn = get_fam_conn(self, "monitor collection");
+  VALUE col, depth, mask, opts, ret;
+  FamReq *rec;
+  int err;
+
+  rb_scan_args(argc, argv, "31", &col, &depth, &mask, &opts);
+  StringValue(col);
+  StringValue(mask);
+
+  ret = new_req(REQ_MONITOR, get_context(opts), &rec);
+  rec->filter = get_filter(opts, StringValueCStr(mask));
+  conn_lock(conn);
+  err = FAMMonitorCollection(&(conn->fc),
+                             RSTRING_PTR(col),
+                             &(rec->req),
+                             rec,
+                             NUM2INT(depth),
+                             RSTRING_PTR(mask));
+  conn_unlock(conn);
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't monitor collection [\"%s\", %d, \"%s\"]: %s",
+             RSTRING_PTR(col) ? RSTRING_PTR(col) : "NULL",
+             NUM2INT(depth),
+             RSTRING_PTR(mask) ? RSTRING_PTR(mask) : "NULL",
+	     fam_error());
+  }
+
+  conn_add_req(conn, rec);
+  return ret;
+}
+#endif /* HAVE_FAMMONITORCOLLECTION */
+
+#ifdef HAVE_FAMSUSPENDMONITOR
+/*
+ * Suspend (stop monitoring) a monitor request.
+ *
+ * Raises a Fam::Error exception if the monitor request could not be
+ * suspended.  Note that this method exists under Gamin, but does not
+ * actually do anything.
+ * 
+ * Aliases:
+ *   Fam::Connection#suspend
+ *
+ * Examples:
+ *   fam.suspend_monitor req
+ *   fam.suspend req
+ *
+ */
+static VALUE fam_conn_suspend(VALUE self, VALUE request)
+{
+  FamConn *conn = get_fam_conn(self, "suspend monitor request");
+  FamReq *rec;
+  int err;
+
+  rec = conn_req(conn, request);
+  conn_lock(conn);
+  err = FAMSuspendMonitor(&(conn->fc), &(rec->req));
+  conn_unlock(conn);
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't suspend monitor request %d: %s",
+             FAMREQUEST_GETREQNUM(&(rec->req)), fam_error());
+  }
+
+  return self;
+}
+#endif /* HAVE_FAMSUSPENDMONITOR */
+
+#ifdef HAVE_FAMRESUMEMONITOR
+/*
+ * Resume (start monitoring) a monitor request.
+ *
+ * Raises a Fam::Error exception if the monitor request could not be
+ * resumed.  Note that this method exists under Gamin, but does not
+ * actually do anything.
+ * 
+ * Aliases:
+ *   Fam::Connection#resume
+ *
+ * Examples:
+ *   fam.resume_monitor req
+ *   fam.resume req
+ *
+ */
+static VALUE fam_conn_resume(VALUE self, VALUE request)
+{
+  FamConn *conn = get_fam_conn(self, "resume monitor request");
+  FamReq *rec;
+  int err;
+
+  rec = conn_req(conn, request);
+  conn_lock(conn);
+  err = FAMResumeMonitor(&(conn->fc), &(rec->req));
+  conn_unlock(conn);
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't resume monitor request %d: %s",
+             FAMREQUEST_GETREQNUM(&(rec->req)), fam_error());
+  }
+
+  return self;
+}
+#endif /* HAVE_FAMRESUMEMONITOR */
+
+/*
+ * Cancel a monitor request.
+ *
+ * Raises a Fam::Error exception if the monitor request could not be
+ * cancelled, or if it was already cancelled or its connection closed.
+ *
+ * Note: this method invalidates the specified monitor request; it can't
+ * be suspended, resumed or cancelled again.  The request stays on the
+ * connection until the daemon acknowledges the cancellation (see
+ * Fam::Request#active?), and its caches are released then.
+ *
+ * Aliases:
+ *   Fam::Connection#cancel
+ *
+ * Examples:
+ *   fam.cancel_monitor req
+ *   fam.cancel req
+ *
+ */
+static VALUE fam_conn_cancel(VALUE self, VALUE request)
+{
+  FamConn *conn = get_conn(self);
+  FamReq *rec;
+  int err;
+
+  rec = conn_req(conn, request);
+  conn->stats.cancelled++;
+  if (rec->head.type == REQ_TREE) {
+    rec->cancelled = 1;
+    if (rec->tree)
+      tree_cancel(conn, rec->tree);
+    return self;
+  }
+
+  err = backend_cancel(conn, &(rec->req));
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't cancel monitor request %d: %s",
+             FAMREQUEST_GETREQNUM(&(rec->req)), backend_error(conn));
+  }
+
+  rec->cancelled = 1;
+  return self;
+}
+
+/*
+ * Convert an optional timeout argument (in seconds) to a double.
+ * Returns -1 if timeout is nil (wait forever).
+ */
+static double get_timeout(VALUE timeout)
+{
+  double ret;
+
+  if (NIL_P(timeout))
+    return -1;
+
+  if ((ret = NUM2DBL(timeout)) < 0)
+    rb_raise(rb_eArgError, "invalid timeout (negative)");
+
+  return ret;
+}
+
+typedef struct {
+  int fd;
+  int msec;   /* -1 to wait forever */
+  int ret;
+  int err;
+  short revents;
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  VALUE scheduler;  /* fiber scheduler, or nil */
+  VALUE io;         /* IO for fd, if there is a scheduler */
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+} WaitArgs;
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void *wait_fd_nogvl(void *ptr)
+{
+  WaitArgs *args = ptr;
+  struct pollfd pfd;
+
+  pfd.fd = args->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  args->ret = poll(&pfd, 1, args->msec);
+  args->err = errno;
+  args->revents = pfd.revents;
+
+  return NULL;
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+/*
+ * Return an IO object for the given descriptor, for handing to a fiber
+ * scheduler.  The object is cached on the connection, and never closes
+ * the descriptor.
+ */
+static VALUE conn_io(FamConn *conn, int fd)
+{
+  VALUE args[2], opts;
+
+  if (!RTEST(conn->io) || conn->io_fd != fd) {
+    opts = rb_hash_new();
+    rb_hash_aset(opts, ID2SYM(rb_intern("autoclose")), Qfalse);
+    args[0] = INT2NUM(fd);
+    args[1] = opts;
+    conn->io = rb_funcallv_kw(rb_cIO, rb_intern("for_fd"), 2, args,
+                              RB_PASS_KEYWORDS);
+    conn->io_fd = fd;
+  }
+
+  return conn->io;
+}
+
+/*
+ * Wait by yielding to the fiber scheduler until the descriptor is
+ * readable or the timeout expires.
+ */
+static void wait_fd_fiber(WaitArgs *args)
+{
+  VALUE timeout = (args->msec < 0) ? Qnil : rb_float_new(args->msec / 1000.0);
+  VALUE ret = rb_fiber_scheduler_io_wait(args->scheduler, args->io,
+                                         INT2NUM(RUBY_IO_READABLE), timeout);
+
+  /* the scheduler returns the ready events, or false on timeout */
+  args->ret = FIXNUM_P(ret) ? (FIX2INT(ret) != 0) : RTEST(ret);
+  args->err = 0;
+  args->revents = args->ret ? POLLIN : 0;
+}
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+/*
+ * Wait until the given descriptor is readable or the timeout expires.
+ * The GVL is released while waiting, so other threads keep running,
+ * and the wait is interrupted by signals and Thread#raise.  If the
+ * current fiber is non-blocking, the wait is handed to the fiber
+ * scheduler instead, so other fibers keep running too.
+ *
+ * The wait uses poll(), so it works with descriptors numbered above
+ * FD_SETSIZE.
+ */
+static void wait_fd(WaitArgs *args)
+{
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  if (!NIL_P(args->scheduler)) {
+    wait_fd_fiber(args);
+    return;
+  }
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(wait_fd_nogvl, args, RUBY_UBF_IO, 0);
+#else
+  struct timeval tv, *tvp = NULL;
+  fd_set rfds;
+
+  if (args->fd >= FD_SETSIZE)
+    rb_raise(eError, "Couldn't wait for FAM events: descriptor %d is "
+             "larger than FD_SETSIZE", args->fd);
+
+  if (args->msec >= 0) {
+    tv.tv_sec = args->msec / 1000;
+    tv.tv_usec = (args->msec % 1000) * 1000;
+    tvp = &tv;
+  }
+
+  FD_ZERO(&rfds);
+  FD_SET(args->fd, &rfds);
+  args->ret = rb_thread_select(args->fd + 1, &rfds, NULL, NULL, tvp);
+  args->err = errno;
+  args->revents = (args->ret > 0) ? POLLIN : 0;
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  if (args->ret == -1 && args->err != EINTR)
+    rb_raise(eError, "Couldn't wait for FAM events: %s", strerror(args->err));
+
+  /* a hangup without readable data means the daemon went away; bail
+   * out instead of spinning on a dead descriptor */
+  if (args->ret > 0 && !(args->revents & POLLIN) &&
+      (args->revents & (POLLERR | POLLHUP | POLLNVAL)))
+    rb_raise(eError, "Couldn't wait for FAM events: %s",
+             (args->revents & POLLNVAL) ? "invalid descriptor" :
+                                          "connection closed");
+}
+
+/*
+ * Raw event source for the consumer: the reader thread's ring in
+ * reader mode, or the backend itself.  These follow the backend
+ * conventions (return -1 on error).
+ */
+static int conn_raw_pending(FamConn *conn)
+{
+#ifdef USE_READER
+  if (conn->reader)
+    return reader_pending(conn->reader);
+#endif /* USE_READER */
+  return backend_pending(conn);
+}
+
+static int conn_raw_next(FamConn *conn, FAMEvent *ev)
+{
+#ifdef USE_READER
+  if (conn->reader)
+    return reader_shift(conn->reader, ev, &(conn->meta.received)) ? 0 : -1;
+#endif /* USE_READER */
+  if (backend_next(conn, ev) == -1)
+    return -1;
+  conn->meta.received = fam_now();
+  return 0;
+}
+
+static int conn_raw_fd(FamConn *conn)
+{
+#ifdef USE_READER
+  if (conn->reader)
+    return conn->reader->notify[0];
+#endif /* USE_READER */
+  return backend_fd(conn);
+}
+
+/*
+ * Block until at least one FAM event is pending on the given connection
+ * or until timeout seconds have elapsed (forever if timeout is
+ * negative).  Returns 1 if an event is pending, or 0 on timeout.
+ */
+static int conn_wait(FamConn *conn, double timeout)
+{
+  double deadline = (timeout < 0) ? 0 : fam_now() + timeout;
+  double start;
+  WaitArgs args;
+  int err;
+
+  args.fd = conn_raw_fd(conn);
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+  args.scheduler = rb_fiber_scheduler_current();
+  args.io = NIL_P(args.scheduler) ? Qnil : conn_io(conn, args.fd);
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+  for (;;) {
+    if ((err = conn_raw_pending(conn)) == -1)
+      rb_raise(eError, "Couldn't check for pending FAM events: %s",
+               backend_error(conn));
+    if (err)
+      return 1;
+
+#ifdef USE_READER
+    /* clear stale wakeups, then make sure nothing slipped in between */
+    if (conn->reader) {
+      reader_clear(conn->reader);
+      if (reader_pending(conn->reader))
+        return 1;
+    }
+#endif /* USE_READER */
+
+    args.msec = -1;
+    if (timeout >= 0) {
+      double left = deadline - fam_now();
+
+      if (left <= 0)
+        return 0;
+
+      /* round up, so we don't spin on sub-millisecond remainders */
+      args.msec = (left > INT_MAX / 1000) ? INT_MAX : (int) (left * 1000 + 0.999);
+    }
+
+    start = fam_now();
+    conn->stats.waits++;
+    FAM_PROBE2(wait_start, args.fd, args.msec);
+    wait_fd(&args);
+    FAM_PROBE2(wait_done, args.fd, args.ret);
+    conn->stats.wait_time += fam_now() - start;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_check_ints();
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+  }
+}
+
+/*
+ * Run an event through the connection's event processing.  Returns 0
+ * if the event was consumed internally and shouldn't be delivered.
+ */
+static int conn_process(FamConn *conn, FAMEvent *ev)
+{
+  ReqHead *head = ev->userdata;
+  FamReq *rec;
+
+  if (!head) {
+    /* lost events for every request */
+    if (ev->code == FAMOverflow)
+      for (rec = conn->reqs; rec; rec = rec->next)
+        if (!NIL_P(rec->state))
+          get_ds(rec->state)->stale = 1;
+    return 1;
+  }
+
+  switch (head->type) {
+    case REQ_TREE_NODE:
+      return tree_process(conn, (TreeNode*) head, ev);
+    case REQ_MONITOR:
+      rec = (FamReq*) head;
+      if (!NIL_P(rec->state))
+        ds_update(get_ds(rec->state), ev);
+      /* before fingerprinting, so snapshot listings aren't hashed */
+      if ((ev->code == FAMExists || ev->code == FAMEndExist) &&
+          rec->skip_exists)
+        return 0;
+      if (rec->fp && !fp_process(rec->fp, rec->filter, ev, &(conn->meta.flags))) {
+        conn->stats.unchanged++;
+        return 0;
+      }
+      if (ev->code == FAMAcknowledge)
+        conn_forget_req(conn, rec);
+      break;
+  }
+
+  return 1;
+}
+
+/*
+ * Read the next (already pending) FAM event.  Returns 0 if the event
+ * shouldn't be delivered, and 2 if it should be held for move tracking.
+ */
+static int conn_read(FamConn *conn, FAMEvent *ev)
+{
+  FamReq *rec;
+  int ret;
+
+  if (conn_raw_next(conn, ev) == -1)
+    rb_raise(eError, "Couldn't get next FAM event: %s", backend_error(conn));
+  conn->stats.read++;
+  conn->meta.flags = 0;
+  conn->meta.from = Qnil;
+
+  if (!conn_process(conn, ev)) {
+    conn->stats.filtered++;
+    return 0;
+  }
+
+  if (ev->code == FAMOverflow)
+    conn->overflows++;
+
+  /* after processing, userdata is always a request record (or NULL) */
+  rec = ev->userdata;
+  ret = !rec || !rec->filter || filter_match(rec->filter, ev);
+  if (conn->mv.window)
+    ret = mv_process(&(conn->mv), &(conn->co), ev, ret);
+
+  if (!ret)
+    conn->stats.filtered++;
+  return ret;
+}
+
+/*
+ * Count an event on its way out to Ruby.  Returns 1.
+ */
+static int conn_deliver(FamConn *conn, const FAMEvent *ev)
+{
+  if (ev->code >= 0 && ev->code <= FAMOverflow)
+    conn->stats.events[ev->code]++;
+  conn->stats.filename_bytes += strlen(ev->filename) + 1;
+  return 1;
+}
+
+/*
+ * Get the next event without blocking.  Returns 0 if no event is ready.
+ *
+ * If coalescing is enabled, everything pending is read into the
+ * coalescing queue first, and held events are only returned once their
+ * coalescing window has passed.
+ */
+static int conn_poll_ev(FamConn *conn, FAMEvent *ev)
+{
+  double now = conn->co.head ? fam_now() : 0, ready;
+  int err, ret;
+  CoEv *e;
+
+  for (;;) {
+    if (co_shift(&(conn->co), ev, now, &(conn->meta)))
+      return conn_deliver(conn, ev);
+
+    if ((err = conn_raw_pending(conn)) == -1)
+      rb_raise(eError, "Couldn't check for pending FAM events: %s",
+               backend_error(conn));
+    if (!err)
+      return 0;
+    if (!(ret = conn_read(conn, ev)))
+      continue;
+
+    if (ret == 1 && !conn->coalesce && !conn->co.head)
+      return conn_deliver(conn, ev);
+
+    if (!now)
+      now = fam_now();
+    ready = conn->coalesce ? now + conn->coalesce : 0;
+    if (ret == 2 && ready < now + conn->mv.window)
+      ready = now + conn->mv.window;
+    e = co_push(&(conn->co), ev, ready, &(conn->meta));
+    if (ret == 2 && e)
+      co_hold(&(conn->co), e, &(conn->mv.deleted), ready);
+  }
+}
+
+/*
+ * Get the next event, waiting at most timeout seconds (forever if
+ * timeout is negative).  Returns 0 on timeout.
+ */
+static int conn_get_ev(FamConn *conn, FAMEvent *ev, double timeout)
+{
+  double deadline = (timeout < 0) ? 0 : fam_now() + timeout;
+
+  for (;;) {
+    double now, left = -1;
+
+    if (conn_poll_ev(conn, ev))
+      return 1;
+
+    now = fam_now();
+    if (timeout >= 0 && (left = deadline - now) <= 0)
+      return 0;
+
+    /* wake up when the oldest held event is due */
+    if (conn->co.head && (left < 0 || conn->co.head->ready - now < left))
+      left = conn->co.head->ready - now;
+
+    conn_wait(conn, (left < 0) ? -1 : left);
+  }
+}
+
+/*
+ * Read pending events into ary until the queue is empty or ary holds
+ * max events.
+ */
+static VALUE conn_read_evs(FamConn *conn, VALUE ary, long max)
+{
+  FAMEvent ev;
+
+  while (RARRAY_LEN(ary) < max && conn_poll_ev(conn, &ev))
+    rb_ary_push(ary, wrap_ev(&ev, &(conn->meta)));
+
+  return ary;
+}
+
+/*
+ * Convert an optional maximum event count argument to a long.
+ */
+static long get_max_evs(VALUE max)
+{
+  long ret;
+
+  if (NIL_P(max))
+    return LONG_MAX;
+
+  if ((ret = NUM2LONG(max)) < 1)
+    rb_raise(rb_eArgError, "invalid maximum event count (not positive)");
+
+  return ret;
+}
+
+/*
+ * Get the next event from the event queue, or block until an event is
+ * available.  If timeout (in seconds) is specified, wait at most that
+ * long and return nil if no event arrived.
+ *
+ * Other threads keep running while this method is blocked.  Under a
+ * fiber scheduler (Ruby 3.0 or newer), the wait yields to the
+ * scheduler instead, so other fibers keep running too.
+ *
+ * Raises an ArgumentError exception if timeout is negative, or a
+ * Fam::Error exception if FAM couldn't check for pending events, or if
+ * FAM-Ruby couldn't get the next FAM event.
+ * 
+ * Aliases:
+ *   Fam::Connection#next_ev
+ *   Fam::Connection#ev
+ *
+ * Examples:
+ *   # wait forever
+ *   ev = fam.next_event
+ *
+ *   # wait at most 2.5 seconds
+ *   puts 'nothing happened' unless ev = fam.next_event(2.5)
+ *
+ */
+static VALUE fam_conn_next_ev(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn;
+  FAMEvent ev;
+  VALUE timeout;
+  double t;
+
+  rb_scan_args(argc, argv, "01", &timeout);
+  t = get_timeout(timeout);
+
+  conn = get_conn(self);
+  if (!conn_get_ev(conn, &ev, t))
+    return Qnil;
+
+  return wrap_ev(&ev, &(conn->meta));
+}
+
+/*
+ * Get an array of events from the event queue, blocking until at least
+ * one event is available.  At most max events are returned; if max is
+ * nil, every pending event is returned.  If timeout (in seconds) is
+ * specified, wait at most that long and return nil if no event arrived.
+ *
+ * This is considerably faster than calling Fam::Connection#pending? and
+ * Fam::Connection#next_event in a loop when events arrive in bursts.
+ *
+ * Raises an ArgumentError exception if max is not positive or timeout
+ * is negative, or a Fam::Error exception if FAM couldn't check for
+ * pending events, or if FAM-Ruby couldn't get the next FAM event.
+ *
+ * Aliases:
+ *   Fam::Connection#next_evs
+ *
+ * Examples:
+ *   # get every pending event (at least one)
+ *   evs = fam.next_events
+ *
+ *   # get at most 100 events
+ *   evs = fam.next_events 100
+ *
+ *   # get every pending event, waiting at most one second
+ *   evs = fam.next_events nil, 1
+ *
+ */
+static VALUE fam_conn_next_evs(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn;
+  FAMEvent ev;
+  VALUE max, timeout;
+  double t;
+  long n;
+
+  rb_scan_args(argc, argv, "02", &max, &timeout);
+  n = get_max_evs(max);
+  t = get_timeout(timeout);
+
+  conn = get_conn(self);
+  if (!conn_get_ev(conn, &ev, t))
+    return Qnil;
+
+  return conn_read_evs(conn, rb_ary_new3(1, wrap_ev(&ev, &(conn->meta))), n);
+}
+
+/*
+ * Get an array of every pending event in the event queue, without
+ * blocking.  At most max events are returned; if max is nil, every
+ * pending event is returned.  Returns an empty array if there are no
+ * pending events.
+ *
+ * Raises an ArgumentError exception if max is not positive, or a
+ * Fam::Error exception if FAM couldn't check for pending events, or if
+ * FAM-Ruby couldn't get the next FAM event.
+ *
+ * Examples:
+ *   fam.drain.each { |ev| puts ev }
+ *
+ */
+static VALUE fam_conn_drain(int argc, VALUE *argv, VALUE self)
+{
+  FamConn *conn;
+  VALUE max;
+  long n;
+
+  rb_scan_args(argc, argv, "01", &max);
+  n = get_max_evs(max);
+
+  conn = get_conn(self);
+  return conn_read_evs(conn, rb_ary_new(), n);
+}
+
+/*
+ * Iterate over events as they arrive, blocking while the event queue is
+ * empty.  The code, request number and filename of each event are
+ * yielded to the block directly; no Fam::Event objects are allocated,
+ * and a single FAMEvent buffer is reused for every event.  Use break to
+ * leave the loop.
+ *
+ * Raises a Fam::Error exception if FAM couldn't check for pending
+ * events, or if FAM-Ruby couldn't get the next FAM event.
+ *
+ * Aliases:
+ *   Fam::Connection#each_ev
+ *
+ * Examples:
+ *   fam.each_event do |code, reqnum, file|
+ *     puts 'deleted: ' << file if code == Fam::Event::DELETED
+ *   end
+ *
+ */
+static VALUE fam_conn_each_ev(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+  FAMEvent ev;
+
+  for (;;) {
+    conn_get_ev(conn, &ev, -1);
+    rb_yield_values(3, INT2FIX(ev.code),
+                    INT2NUM(FAMREQUEST_GETREQNUM(&(ev.fr))),
+                    rb_str_new2(ev.filename));
+  }
+
+  return self;
+}
+
+/*
+ * Are there any events in the queue?
+ *
+ * Raises a Fam::Error exception if FAM couldn't check for pending
+ * events.
+ *
+ * Aliases:
+ *   Fam::Connection#pending
+ *
+ * Examples:
+ *   puts 'no events pending' unless fam.pending?
+ *
+ */
+static VALUE fam_conn_pending(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+  int err;
+
+  /* held events count once their coalescing window has passed */
+  if (conn->co.head && conn->co.head->ready <= fam_now())
+    return Qtrue;
+
+  err = conn_raw_pending(conn);
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't check for pending FAM events: %s",
+             backend_error(conn));
+  }
+
+  return (err > 0) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the event coalescing window, in seconds.
+ *
+ * While coalescing is enabled, CHANGED, CREATED and DELETED events are
+ * held for the given window, and later events for the same file and
+ * monitor are folded into the held event: a burst of writes to a file
+ * is delivered as a single CHANGED event, a file which is created and
+ * deleted within the window isn't reported at all, and so on.  Events
+ * are still delivered in the order they arrived.
+ *
+ * Set the window to nil or 0 to disable coalescing; held events are
+ * released immediately.
+ *
+ * Note: held events don't make Fam::Connection#fd readable, so code
+ * which waits on the descriptor itself should call
+ * Fam::Connection#drain at least once per window.
+ *
+ * Raises an ArgumentError exception if the window is negative.
+ *
+ * Examples:
+ *   # fold events which arrive within 50ms of each other
+ *   fam.coalesce = 0.05
+ *
+ */
+static VALUE fam_conn_set_coalesce(VALUE self, VALUE window)
+{
+  FamConn *conn = get_conn(self);
+  double val = 0;
+
+  if (!NIL_P(window) && (val = NUM2DBL(window)) < 0)
+    rb_raise(rb_eArgError, "invalid coalescing window (negative)");
+
+  if (!(conn->coalesce = val))
+    co_flush(&(conn->co));
+
+  return window;
+}
+
+/*
+ * Get the event coalescing window, in seconds, or nil if coalescing is
+ * disabled.
+ *
+ * Examples:
+ *   puts 'coalescing' if fam.coalesce
+ *
+ */
+static VALUE fam_conn_coalesce(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+
+  return conn->coalesce ? rb_float_new(conn->coalesce) : Qnil;
+}
+
+/*
+ * Get the number of events which were folded into other events (or
+ * cancelled out) by coalescing on this connection.
+ *
+ * Examples:
+ *   puts "saved #{fam.coalesced} events"
+ *
+ */
+static VALUE fam_conn_coalesced(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+
+  return ULONG2NUM(conn->co.folded);
+}
+
+/*
+ * Set the move tracking window, in seconds.
+ *
+ * FAM reports a rename as a DELETED event for the old name followed by
+ * a CREATED event for the new one (Fam::Event::MOVED isn't sent on
+ * Linux).  With move tracking enabled, the connection stats each entry
+ * as its EXISTS, CREATED and CHANGED events are read, and remembers its
+ * device, inode, size and mtime, across all of its monitors.  A
+ * DELETED event for a known entry is then held for the window, and if
+ * a CREATED event for the same file arrives in time, both are replaced
+ * by a single MOVED event, with the new name in Fam::Event#filename
+ * and the old one in Fam::Event#old_filename.  Files moving between
+ * monitored directories are paired too; see Fam::Event#old_monitor.
+ *
+ * When a directory inside a tree monitor (see
+ * Fam::Connection#monitor_tree) is renamed, the MOVED event for the
+ * directory stands for everything below it: the CREATED events for its
+ * contents, which the new directory's monitors would otherwise report,
+ * are dropped.
+ *
+ * Enable tracking before adding monitors, so that their EXISTS events
+ * are seen; entries are only known once an event has been read for
+ * them.  Without coalescing (see Fam::Connection#coalesce=), the
+ * CREATED event has to be the next event read after the DELETED one,
+ * which is how renames arrive; any other event releases the held
+ * DELETED event.  Held events don't make Fam::Connection#fd readable.
+ *
+ * Set the window to nil or 0 to disable tracking and forget every
+ * entry.  Pairs are counted in Fam::Connection#stats as :moves.
+ *
+ * Raises an ArgumentError exception if the window is negative.
+ *
+ * Examples:
+ *   fam.track_moves = 0.05
+ *   fam.monitor_tree 'src'
+ *   while ev = fam.next_event
+ *     if ev.old_filename
+ *       index.rename(ev.old_filename, ev.filename)
+ *     else
+ *       index.update(ev)
+ *     end
+ *   end
+ *
+ */
+static VALUE fam_conn_set_track_moves(VALUE self, VALUE window)
+{
+  FamConn *conn = get_conn(self);
+  double val = 0;
+
+  if (!NIL_P(window) && (val = NUM2DBL(window)) < 0)
+    rb_raise(rb_eArgError, "invalid move tracking window (negative)");
+
+  if (!(conn->mv.window = val))
+    mv_clear(&(conn->mv));
+
+  return window;
+}
+
+/*
+ * Get the move tracking window, in seconds, or nil if move tracking is
+ * disabled.
+ *
+ * Examples:
+ *   puts 'tracking moves' if fam.track_moves
+ *
+ */
+static VALUE fam_conn_track_moves(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+
+  return conn->mv.window ? rb_float_new(conn->mv.window) : Qnil;
+}
+
+/*
+ * Get the number of OVERFLOW events delivered on this connection.
+ *
+ * Examples:
+ *   warn 'fell behind' if fam.overflows > 0
+ *
+ */
+static VALUE fam_conn_overflows(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+
+  return ULONG2NUM(conn->overflows);
+}
+
+/*
+ * Get the number of events dropped by the overflow policy (see
+ * Fam::Connection.new).
+ *
+ * Examples:
+ *   puts "dropped #{fam.dropped} events"
+ *
+ */
+static VALUE fam_conn_dropped(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+
+#ifdef USE_READER
+  if (conn->reader)
+    return SIZET2NUM(RING_LOAD(&(conn->reader->dropped)));
+#endif /* USE_READER */
+  return INT2FIX(0);
+}
+
+/*
+ * Get the number of events buffered inside the extension: events in
+ * the reader ring (see Fam::Connection.new) plus events held for
+ * coalescing (see Fam::Connection#coalesce=).  Events still queued in
+ * the daemon or the kernel aren't counted.
+ *
+ * Examples:
+ *   puts "#{fam.queue_depth} events waiting"
+ *
+ */
+static VALUE fam_conn_queue_depth(VALUE self)
 {
-  FAMClose((FAMConnection*) conn);
-  xfree(conn);
-}
+  FamConn *conn = get_conn(self);
+  size_t ret = conn->co.count;
 
-static VALUE fam_conn_s_alloc(VALUE klass)
-{
-  FAMConnection *conn = ALLOC(FAMConnection);
-  memset(conn, 0, sizeof(FAMConnection));
-  return Data_Wrap_Struct(klass, 0, fam_conn_free, conn);
+#ifdef USE_READER
+  if (conn->reader)
+    ret += RING_LOAD(&(conn->reader->tail)) - RING_LOAD(&(conn->reader->head));
+#endif /* USE_READER */
+  return SIZET2NUM(ret);
 }
 
-#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
 /*
- * Create a new connection to the FAM daemon.
+ * Get a hash of counters for this connection.  The counters are
+ * maintained with plain increments as events flow through the
+ * extension, so they're cheap enough to leave on in production.
  *
- * Examples:
- *   # connect and tell FAM the application is named 'foo'
- *   fam = Fam::Connection.new 'foo'
+ * Keys:
+ *   :events          hash of event codes (Fam::Event::CHANGED, etc) to
+ *                    the number of events delivered with that code
+ *   :events_read     raw events read from the backend (or reader)
+ *   :events_filtered raw events consumed internally or dropped by
+ *                    request filters
+ *   :coalesced       events folded by coalescing
+ *   :overflows       OVERFLOW events delivered
+ *   :dropped         events dropped by the overflow policy
+ *   :queue_depth     events buffered inside the extension
+ *   :requests        monitor requests registered
+ *   :live_requests   requests which haven't been acknowledged as
+ *                    cancelled yet
+ *   :cancelled       cancel_monitor calls
+ *   :pending_calls   checks for pending events (FAMPending calls, for
+ *                    the FAM backend)
+ *   :waits           times a caller blocked waiting for events
+ *   :wait_time       seconds spent blocked waiting for events
+ *   :filename_bytes  bytes of filename data delivered to Ruby
+ *   :unchanged       CHANGED events dropped because the file's
+ *                    fingerprint didn't change
+ *   :moves           MOVED events put together by move tracking
  *
- *   # just connect
- *   fam = Fam::Connection.new
+ * Examples:
+ *   stats = fam.stats
+ *   puts "#{stats[:events][Fam::Event::CHANGED]} changes"
  *
  */
-static VALUE fam_conn_s_new(int argc, VALUE *argv, VALUE klass)
+static VALUE fam_conn_stats(VALUE self)
 {
-  VALUE self = fam_conn_s_alloc(klass);
+  FamConn *conn = get_conn(self);
+  ConnStats *st = &(conn->stats);
+  VALUE ret = rb_hash_new(), evs = rb_hash_new();
+  int i;
 
-  rb_obj_call_init(self, argc, argv);
-  return self;
-}
-#endif
+#define STAT(key, val) rb_hash_aset(ret, ID2SYM(rb_intern(key)), (val))
+  for (i = FAMChanged; i <= FAMOverflow; i++)
+    rb_hash_aset(evs, INT2FIX(i), ULONG2NUM(st->events[i]));
 
-static VALUE conn_close(VALUE self)
-{
-  return rb_funcall(self, rb_intern("close"), 0, 0);
+  STAT("events", evs);
+  STAT("events_read", ULONG2NUM(st->read));
+  STAT("events_filtered", ULONG2NUM(st->filtered));
+  STAT("coalesced", ULONG2NUM(conn->co.folded));
+  STAT("overflows", ULONG2NUM(conn->overflows));
+  STAT("dropped", fam_conn_dropped(self));
+  STAT("queue_depth", fam_conn_queue_depth(self));
+  STAT("requests", ULONG2NUM(st->requests));
+  STAT("live_requests", ULONG2NUM(st->live));
+  STAT("cancelled", ULONG2NUM(st->cancelled));
+  STAT("pending_calls", ULONG2NUM(st->pending_calls));
+  STAT("waits", ULONG2NUM(st->waits));
+  STAT("wait_time", rb_float_new(st->wait_time));
+  STAT("filename_bytes", ULONG2NUM(st->filename_bytes));
+  STAT("unchanged", ULONG2NUM(st->unchanged));
+  STAT("moves", ULONG2NUM(conn->mv.moves));
+#undef STAT
+
+  return ret;
 }
 
 /*
- * Create a new connection to the FAM daemon.
+ * Record the time elapsed since a Fam::Event object was received (see
+ * Fam::Event#received_at) in the latency histograms of the connection
+ * and of the event's monitor.  Call this once an event has been
+ * handled.  Returns self.
  *
- * Aliases:
- *   Fam::Connection.open2
+ * Histograms are created on first use and have a resolution of 1/16 of
+ * the recorded value; recording doesn't allocate Ruby objects.
  *
  * Examples:
- *   # connect and tell FAM the application is named 'foo'
- *   fam = Fam::Connection.open 'foo'
- *
- *   # just connect
- *   fam = Fam::Connection.open
- *
- *   # connect and close automatically
- *   Fam::Connection.open('foo') {|fam| ... }
+ *   while ev = fam.next_event
+ *     handle(ev)
+ *     fam.record_latency(ev)
+ *   end
+ *   puts "p99: #{fam.latency(99)}s"
  *
  */
-static VALUE
-fam_conn_s_open(int argc, VALUE *argv, VALUE klass)
+static VALUE fam_conn_record_latency(VALUE self, VALUE event)
 {
-  VALUE self = rb_class_new_instance(argc, argv, klass);
+  FamConn *conn = get_conn(self);
+  double now = fam_now();
+  FamEv *ev;
 
-  if (rb_block_given_p()) {
-    return rb_ensure(rb_yield, self, conn_close, self);
+  TypedData_Get_Struct(event, FamEv, &fam_ev_type, ev);
+
+  hist_record(&(conn->latency), ev->meta.received, now);
+  if (!NIL_P(ev->request)) {
+    FamReq *rec = get_req(ev->request);
+    hist_record(&(rec->latency), ev->meta.received, now);
   }
 
   return self;
 }
 
 /*
- * Create a new connection to the FAM daemon.
+ * Return the pct percentile (0 to 100) of the latencies recorded with
+ * Fam::Connection#record_latency, in seconds, or nil if none have been
+ * recorded.  See Fam::Request#latency for per-monitor latencies.
  *
- * Raises an ArgumentError exception if the number of arguments is not 0
- * or 1, or a Fam::Error exception if a connection to FAM could not
- * be established.
+ * Raises an ArgumentError exception if pct is out of range.
  *
  * Examples:
- *   # connect and tell FAM the application is named 'foo'
- *   fam = Fam::Connection.new 'foo'
+ *   puts "median: #{fam.latency(50)}s, p99: #{fam.latency(99)}s"
  *
- *   # just connect
- *   fam = Fam::Connection.new
+ */
+static VALUE fam_conn_latency(VALUE self, VALUE pct)
+{
+  return hist_percentile(get_conn(self)->latency, pct);
+}
+
+/*
+ * Discard the latencies recorded on a connection and on each of its
+ * monitors.  Returns self.
+ *
+ * Examples:
+ *   # report latencies per minute
+ *   loop do
+ *     sleep 60
+ *     puts fam.latency(99)
+ *     fam.reset_latency
+ *   end
  *
  */
-static VALUE fam_conn_init(int argc, VALUE *argv, VALUE self)
+static VALUE fam_conn_reset_latency(VALUE self)
 {
-  FAMConnection *conn;
-  int err = 0;
+  FamConn *conn = get_conn(self);
+  FamReq *rec;
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  switch (argc) {
-    case 0:
-      err = FAMOpen(conn);
-      break;
-    case 1:
-      err = FAMOpen2(conn, RSTRING(argv[0])->ptr);
-      break;
-    default:
-      rb_raise(rb_eArgError, "invalid argument count (not 0 or 1)");
-  }
-  
-  if (err == -1) {
-    rb_raise(eError, "Couldn't open FAM connection: %s", fam_error());
+  free(conn->latency);
+  conn->latency = NULL;
+  for (rec = conn->reqs; rec; rec = rec->next) {
+    free(rec->latency);
+    rec->latency = NULL;
   }
 
   return self;
 }
 
+#ifdef HAVE_FAMDEBUGLEVEL
 /*
- * Close a Fam::Connection.
+ * Set the debug level of a Fam::Connection object.
  *
- * Raises a Fam::Error exception if the connection to FAM could not
- * be closed.
+ * Raises a Fam::Error exception on failure.  Note that this method does
+ * not exist under Gamin.
+ *
+ * Aliases:
+ *   Fam::Connection#debug
  *
  * Examples:
- *   fam.close
+ *   fam.debug = Fam::Debug::VERBOSE
  *
  */
-  
-/* this causes a segfault, since ruby attempts to close the connection
- * when it goes out of scope.  We'll let ruby take care of it. :) */
-static VALUE fam_conn_close(VALUE self)
+static VALUE fam_conn_set_debug(VALUE self, VALUE level)
 {
-  FAMConnection *conn;
+  FamConn *conn = get_conn(self);
   int err;
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  err = FAMClose(conn);
-  DATA_PTR(self) = NULL;
+  /* the inotify backend has nothing to debug */
+  if (conn->backend != BACKEND_FAM)
+    return self;
+
+  conn_lock(conn);
+  err = FAMDebugLevel(&(conn->fc), NUM2INT(level));
+  conn_unlock(conn);
 
   if (err == -1) {
-    rb_raise(eError, "Couldn't close FAM connection: %s", fam_error());
+    rb_raise(eError, "Couldn't set debug level: %s", fam_error());
   }
-  
+
   return self;
 }
+#endif
 
 /*
- * Monitor a directory.
- *
- * Returns a Fam::Request object, which is used to identify the monitor
- * associated with events.
+ * Get the file descriptor of a Fam::Connection object.
  *
- * Raises a Fam::Error exception if the directory could not be
- * monitored.
+ * Note: This method allows you to wait for FAM events using select()
+ * instead of polling via Fam::Connection#pending and
+ * Fam::Connection#next_event; see the second example below for more
+ * information.  Under a fiber scheduler, there is no need for this:
+ * the blocking methods (Fam::Connection#next_event, etc) already wait
+ * through the scheduler.
  *
  * Aliases:
- *   Fam::Connection#monitor_dir
- *   Fam::Connection#directory
- *   Fam::Connection#dir
+ *   Fam::Connection#get_descriptor
+ *   Fam::Connection#descriptor
+ *   Fam::Connection#get_fd
  *
  * Examples:
- *   req = fam.monitor_directory '/tmp'
+ *   # simple use
+ *   fd = fam.fd
+ *
+ *   # wrap the FAM connection descriptor in an IO object for use in a
+ *   # select() call
+ *   io = IO.new fam.fd, 'r'
+ *   select [io], , , 10
+ *   
+ */
+static VALUE fam_conn_fd(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+
+  return INT2FIX(conn_raw_fd(conn));
+}
+
+#ifdef HAVE_FAMNOEXISTS
+/*
+ * Gamin-specific extension for FAM to not propagate Exists events on
+ * directory monitoring startup. This speeds up watching large
+ * directories but can introduce a mismatch between the FAM view of the
+ * directory and the program own view.
+ *
+ * Has no effect if FAMNoExists is not available.
+ *
+ * Raises a Fam::Error exception if an error is encountered.
+ * 
+ * Examples:
+ *   fam.no_exists
+ *
+ */
+static VALUE fam_conn_no_exists(VALUE self)
+{
+  FamConn *conn = get_conn(self);
+  int err;
+
+  conn_lock(conn);
+  err = BACKEND_CALL(conn, FAMNoExists(&(conn->fc)),
+                     (conn->ino.no_exists = 1, 0));
+  conn_unlock(conn);
+
+  if (err == -1) {
+    rb_raise(eError, "Couldn't turn off exists events: %s",
+             backend_error(conn));
+  }
+  return self;
+}
+#endif
+
+/**************/
+/* DISPATCHER */
+/**************/
+
+#if defined(USE_READER) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#define USE_DISPATCHER
+
+#define DISP_LANES_PER_WORKER 16
+#define DISP_DEFAULT_LIMIT    65536
+#define DISP_POLL             0.1   /* seconds between checks for close */
+
+/*
+ * A dispatcher reads events from a connection on one Ruby thread and
+ * hands them to worker threads (or Ractors) through native queues, so
+ * event handling isn't limited to one core.
+ *
+ * Events are hashed by request (or by request and filename) onto
+ * lanes, which are FIFO queues with a home worker each.  A lane belongs
+ * to one worker at a time, from when the worker takes an event from it
+ * until the worker asks for its next event, so the events in a lane
+ * are handled one at a time, in order.  A worker whose own lanes are
+ * all empty or busy steals a ready lane from the worker with the most.
  *
+ * A single mutex protects the lanes.  Queued events are malloc'd
+ * copies, and their Fam::Event objects are created by the worker that
+ * takes them, in its own Ractor.  The request of an event being taken
+ * is copied to the worker's stack while the lock is held, so it is
+ * always reachable either from the dispatcher's mark function or from
+ * a thread stack.
+ */
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+/* an object identifying the current Ractor; see disp_ractor() */
+static rb_ractor_local_key_t disp_ractor_key;
+#endif
+
+typedef struct DispEv {
+  struct DispEv *next;
+  int code;
+  int reqnum;
+  VALUE request;
+  char *hostname;             /* NULL unless from a remote host */
+  EvMeta meta;
+  char filename[1];           /* followed by the old one, for EV_MOVED */
+} DispEv;
+
+typedef struct DispLane {
+  DispEv *head, *tail;
+  struct DispLane *rprev, *rnext; /* home worker's ready list */
+  int home;
+  int owner;                  /* worker handling its last event, or -1 */
+  int ready;                  /* on the ready list */
+} DispLane;
+
+typedef struct {
+  DispLane *rhead, *rtail;    /* lanes with events and no owner */
+  size_t nready;
+  DispLane *held;             /* lane of the event being handled */
+  pthread_cond_t cond;
+  int waiting;
+  int interrupted;
+  int popping;                /* a thread is in Worker#pop */
+  unsigned long events;       /* events taken */
+  unsigned long steals;       /* lanes taken from other workers */
+} DispWorker;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t space;       /* the feeder waits here when full */
+  int feeder_waiting;
+  int feeder_interrupted;
+  long refs;                  /* dispatcher and worker objects */
+  VALUE ractor;               /* the connection's, see disp_ractor() */
+  int closed;
+  int by_filename;
+  size_t queued;
+  size_t limit;
+  size_t mask;                /* lanes - 1 */
+  DispLane *lanes;
+  int nworkers;
+  DispWorker *workers;
+} Dispatch;
+
+/* the Fam::Dispatcher object */
+typedef struct {
+  Dispatch *d;
+  VALUE conn;
+  VALUE workers;              /* frozen array of workers */
+  int running;
+} FamDisp;
+
+/*
+ * Return an object identifying the current Ractor, or nil without
+ * Ractors.  Requests belong to the connection's Ractor, so workers in
+ * other Ractors get detached events (see Fam::Event#detach).
+ */
+static VALUE disp_ractor(void)
+{
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+  VALUE ret = rb_ractor_local_storage_value(disp_ractor_key);
+
+  if (NIL_P(ret)) {
+    ret = rb_obj_alloc(rb_cObject);
+    rb_ractor_local_storage_value_set(disp_ractor_key, ret);
+  }
+  return ret;
+#else
+  return Qnil;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
+}
+
+/* a Fam::Dispatcher::Worker object */
+typedef struct {
+  Dispatch *d;
+  int index;
+} FamDispWorker;
+
+static DispEv *disp_ev_new(const FAMEvent *fe, const EvMeta *meta)
+{
+  size_t len = strlen(fe->filename) + 1;
+  DispEv *de;
+
+  if (meta->flags & EV_MOVED)
+    len += strlen(fe->filename + len) + 1;
+  if (!(de = malloc(offsetof(DispEv, filename) + len)))
+    return NULL;
+
+  de->hostname = NULL;
+  if (fe->hostname && *fe->hostname && !(de->hostname = strdup(fe->hostname))) {
+    free(de);
+    return NULL;
+  }
+
+  de->next = NULL;
+  de->code = fe->code;
+  de->reqnum = FAMREQUEST_GETREQNUM(&(fe->fr));
+  de->request = fe->userdata ? ((FamReq*) fe->userdata)->self : Qnil;
+  de->meta = *meta;
+  memcpy(de->filename, fe->filename, len);
+  return de;
+}
+
+static void disp_ev_free(DispEv *de)
+{
+  free(de->hostname);
+  free(de);
+}
+
+/* wake the lane's home worker, or any waiting worker, to take it */
+static void disp_wake(Dispatch *d, int home)
+{
+  int i;
+
+  if (d->workers[home].waiting) {
+    pthread_cond_signal(&(d->workers[home].cond));
+    return;
+  }
+
+  for (i = 0; i < d->nworkers; i++) {
+    if (d->workers[i].waiting) {
+      pthread_cond_signal(&(d->workers[i].cond));
+      return;
+    }
+  }
+}
+
+/* put a lane with events and no owner on its home worker's ready list */
+static void disp_ready(Dispatch *d, DispLane *lane)
+{
+  DispWorker *w = &(d->workers[lane->home]);
+
+  if (lane->ready || !lane->head || lane->owner >= 0)
+    return;
+
+  lane->rnext = NULL;
+  if ((lane->rprev = w->rtail))
+    w->rtail->rnext = lane;
+  else
+    w->rhead = lane;
+  w->rtail = lane;
+  w->nready++;
+  lane->ready = 1;
+
+  disp_wake(d, lane->home);
+}
+
+static void disp_unready(Dispatch *d, DispLane *lane)
+{
+  DispWorker *w = &(d->workers[lane->home]);
+
+  if (lane->rprev)
+    lane->rprev->rnext = lane->rnext;
+  else
+    w->rhead = lane->rnext;
+  if (lane->rnext)
+    lane->rnext->rprev = lane->rprev;
+  else
+    w->rtail = lane->rprev;
+
+  w->nready--;
+  lane->ready = 0;
+}
+
+static void disp_push(Dispatch *d, DispEv *de)
+{
+  unsigned int hash = co_hash(de->reqnum, d->by_filename ? de->filename : "");
+  DispLane *lane = &(d->lanes[hash & d->mask]);
+
+  if (lane->tail)
+    lane->tail->next = de;
+  else
+    lane->head = de;
+  lane->tail = de;
+  d->queued++;
+
+  disp_ready(d, lane);
+}
+
+/*
+ * Take the next event for worker i, from one of its own ready lanes or
+ * else from the worker with the most.  Returns NULL if there is none.
  */
-static VALUE fam_conn_dir(VALUE self, VALUE dir)
+static DispEv *disp_take(Dispatch *d, int i)
+{
+  DispWorker *w = &(d->workers[i]), *v = NULL;
+  DispLane *lane = w->rhead;
+  DispEv *de;
+  int j;
+
+  if (!lane) {
+    for (j = 0; j < d->nworkers; j++)
+      if (j != i && d->workers[j].nready && (!v || d->workers[j].nready > v->nready))
+        v = &(d->workers[j]);
+    if (!v)
+      return NULL;
+    lane = v->rtail;
+    w->steals++;
+  }
+
+  disp_unready(d, lane);
+  de = lane->head;
+  if (!(lane->head = de->next))
+    lane->tail = NULL;
+  lane->owner = i;
+  w->held = lane;
+  w->events++;
+
+  if (d->queued-- >= d->limit && d->feeder_waiting)
+    pthread_cond_signal(&(d->space));
+  return de;
+}
+
+/* the worker is done with its last event; let its lane go */
+static void disp_release(Dispatch *d, DispWorker *w)
+{
+  DispLane *lane = w->held;
+
+  if (!lane)
+    return;
+
+  w->held = NULL;
+  lane->owner = -1;
+  disp_ready(d, lane);
+}
+
+/* drop every queued event */
+static void disp_clear(Dispatch *d)
+{
+  DispEv *de;
+  size_t i;
+
+  for (i = 0; i <= d->mask; i++) {
+    while ((de = d->lanes[i].head)) {
+      d->lanes[i].head = de->next;
+      disp_ev_free(de);
+    }
+    d->lanes[i].tail = NULL;
+    if (d->lanes[i].ready)
+      disp_unready(d, &(d->lanes[i]));
+  }
+  d->queued = 0;
+}
+
+static void disp_close(Dispatch *d)
+{
+  int i;
+
+  d->closed = 1;
+  for (i = 0; i < d->nworkers; i++)
+    pthread_cond_signal(&(d->workers[i].cond));
+  pthread_cond_signal(&(d->space));
+}
+
+static void disp_destroy(Dispatch *d)
+{
+  int i;
+
+  disp_clear(d);
+  for (i = 0; i < d->nworkers; i++)
+    pthread_cond_destroy(&(d->workers[i].cond));
+  pthread_cond_destroy(&(d->space));
+  pthread_mutex_destroy(&(d->lock));
+  free(d->workers);
+  free(d->lanes);
+  free(d);
+}
+
+/* drop a reference to the shared state, with the lock held */
+static void disp_unref(Dispatch *d)
+{
+  int last = !--d->refs;
+
+  pthread_mutex_unlock(&(d->lock));
+  if (last)
+    disp_destroy(d);
+}
+
+static Dispatch *disp_new(int nworkers, size_t limit, int by_filename)
+{
+  Dispatch *d;
+  size_t lanes = 1, i;
+  int j;
+
+  while (lanes < (size_t) nworkers * DISP_LANES_PER_WORKER)
+    lanes <<= 1;
+
+  if (!(d = calloc(1, sizeof(Dispatch))))
+    return NULL;
+  d->lanes = calloc(lanes, sizeof(DispLane));
+  d->workers = calloc(nworkers, sizeof(DispWorker));
+  if (!d->lanes || !d->workers) {
+    free(d->lanes);
+    free(d->workers);
+    free(d);
+    return NULL;
+  }
+
+  pthread_mutex_init(&(d->lock), NULL);
+  pthread_cond_init(&(d->space), NULL);
+  for (j = 0; j < nworkers; j++)
+    pthread_cond_init(&(d->workers[j].cond), NULL);
+
+  d->mask = lanes - 1;
+  for (i = 0; i < lanes; i++) {
+    d->lanes[i].home = i % nworkers;
+    d->lanes[i].owner = -1;
+  }
+  d->nworkers = nworkers;
+  d->limit = limit;
+  d->by_filename = by_filename;
+  d->refs = 1;
+  return d;
+}
+
+static void fam_disp_mark(void *ptr)
+{
+  FamDisp *disp = ptr;
+  DispEv *de;
+  size_t i;
+
+  rb_gc_mark(disp->conn);
+  rb_gc_mark(disp->workers);
+  if (!disp->d)
+    return;
+  rb_gc_mark(disp->d->ractor);
+
+  /* workers in other Ractors may be taking events right now */
+  pthread_mutex_lock(&(disp->d->lock));
+  for (i = 0; i <= disp->d->mask; i++) {
+    for (de = disp->d->lanes[i].head; de; de = de->next) {
+      rb_gc_mark(de->request);
+      rb_gc_mark(de->meta.from);
+    }
+  }
+  pthread_mutex_unlock(&(disp->d->lock));
+}
+
+static void fam_disp_free(void *ptr)
+{
+  FamDisp *disp = ptr;
+
+  if (disp->d) {
+    /* nothing marks the queued events' requests any more */
+    pthread_mutex_lock(&(disp->d->lock));
+    disp_clear(disp->d);
+    disp_close(disp->d);
+    disp_unref(disp->d);
+  }
+  xfree(disp);
+}
+
+static size_t fam_disp_memsize(const void *ptr)
+{
+  const FamDisp *disp = ptr;
+  size_t ret = sizeof(FamDisp);
+
+  if (disp->d)
+    ret += sizeof(Dispatch) + (disp->d->mask + 1) * sizeof(DispLane) +
+           disp->d->nworkers * sizeof(DispWorker) +
+           disp->d->queued * sizeof(DispEv);
+  return ret;
+}
+
+static const rb_data_type_t fam_disp_type = {
+  "Fam::Dispatcher",
+  { fam_disp_mark, fam_disp_free, fam_disp_memsize, },
+};
+
+static void fam_disp_worker_free(void *ptr)
+{
+  FamDispWorker *h = ptr;
+
+  /* let the other workers have its lane */
+  pthread_mutex_lock(&(h->d->lock));
+  disp_release(h->d, &(h->d->workers[h->index]));
+  disp_unref(h->d);
+  xfree(h);
+}
+
+static size_t fam_disp_worker_memsize(const void *ptr)
+{
+  return sizeof(FamDispWorker);
+}
+
+/* workers hold no Ruby references, so frozen workers are shareable */
+static const rb_data_type_t fam_disp_worker_type = {
+  "Fam::Dispatcher::Worker",
+  { 0, fam_disp_worker_free, fam_disp_worker_memsize, },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | FAM_TYPED_SHAREABLE,
+#endif
+};
+
+static VALUE fam_disp_s_alloc(VALUE klass)
 {
-  FAMConnection *conn;
-  FAMRequest *req = NULL;
-  int err;
+  FamDisp *disp = ALLOC(FamDisp);
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  req = ALLOC(FAMRequest);
-  err = FAMMonitorDirectory(conn, RSTRING(dir)->ptr, req, NULL);
+  disp->d = NULL;
+  disp->conn = Qnil;
+  disp->workers = Qnil;
+  disp->running = 0;
+  return TypedData_Wrap_Struct(klass, &fam_disp_type, disp);
+}
 
-  if (err == -1) {
-    xfree(req);
-    rb_raise(eError, "Couldn't monitor directory \"%s\": %s",
-             RSTRING(dir)->ptr ? RSTRING(dir)->ptr : "NULL", fam_error());
-  }
+static FamDisp *get_disp(VALUE self)
+{
+  FamDisp *disp;
 
-  return wrap_req(req);
+  TypedData_Get_Struct(self, FamDisp, &fam_disp_type, disp);
+  if (!disp->d)
+    rb_raise(eError, "dispatcher is not initialized");
+
+  return disp;
 }
 
 /*
- * Monitor a file.
+ * Create a dispatcher which reads events from a Fam::Connection and
+ * hands them to the given number of workers.
  *
- * Returns a Fam::Request object, which is used to identify the monitor
- * associated with events.
+ * Each worker (see Fam::Dispatcher#workers) is driven by its own thread
+ * or Ractor, calling Fam::Dispatcher::Worker#pop or #each.  One thread
+ * calls Fam::Dispatcher#run to read the connection; nothing else should
+ * read events from the connection meanwhile.
  *
- * Raises a Fam::Error exception if the file could not be monitored.
+ * Events are partitioned onto lanes by request, or with
+ * :partition => :filename, by request and filename.  Events in the same
+ * lane are handled one at a time and in order, so all the events for
+ * a file (or a monitor) are handled in the order they arrived, even
+ * though idle workers steal lanes from busy ones.  Partition by
+ * filename when a few monitors (trees, for example) produce most of the
+ * events, since one request maps to one lane.
  *
- * Aliases:
- *   Fam::Connection#file
+ * Options:
+ *   :partition  :request (the default) or :filename
+ *   :limit      events which may be queued before Fam::Dispatcher#run
+ *               stops reading the connection (default 65536)
+ *
+ * Raises an ArgumentError exception if the number of workers or the
+ * limit isn't positive or the partition is unknown, or a Fam::Error
+ * exception if the connection is closed.
  *
  * Examples:
- *   req = fam.monitor_file '/var/log/messages'
+ *   disp = Fam::Dispatcher.new fam, 4, :partition => :filename
+ *   threads = disp.workers.map do |w|
+ *     Thread.new { w.each { |ev| handle(ev) } }
+ *   end
+ *   Thread.new { disp.run }
  *
  */
-static VALUE fam_conn_file(VALUE self, VALUE file)
+static VALUE fam_disp_init(int argc, VALUE *argv, VALUE self)
 {
-  FAMConnection *conn;
-  FAMRequest *req = NULL;
-  int err;
+  FamDisp *disp;
+  FamDispWorker *h;
+  VALUE conn, workers, opts, val, ary;
+  long n, limit = DISP_DEFAULT_LIMIT, i;
+  int by_filename = 0;
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  req = ALLOC(FAMRequest);
-  FAMREQUEST_GETREQNUM(req) = (int) req;
-  err = FAMMonitorFile(conn, RSTRING(file)->ptr, req, NULL);
+  TypedData_Get_Struct(self, FamDisp, &fam_disp_type, disp);
+  if (disp->d)
+    rb_raise(eError, "dispatcher is already initialized");
 
-  if (err == -1) {
-    xfree(req);
-    rb_raise(eError, "Couldn't monitor file \"%s\": %s",
-             RSTRING(file)->ptr ? RSTRING(file)->ptr : "NULL", fam_error());
+  rb_scan_args(argc, argv, "21", &conn, &workers, &opts);
+  get_conn(conn);
+  if ((n = NUM2LONG(workers)) < 1 || n > INT_MAX)
+    rb_raise(rb_eArgError, "invalid number of workers (not positive)");
+
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("partition")));
+    if (val == ID2SYM(rb_intern("filename")))
+      by_filename = 1;
+    else if (!NIL_P(val) && val != ID2SYM(rb_intern("request")))
+      rb_raise(rb_eArgError, "unknown partition (not :request or :filename)");
+
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("limit")));
+    if (!NIL_P(val) && (limit = NUM2LONG(val)) < 1)
+      rb_raise(rb_eArgError, "invalid limit (not positive)");
+  }
+
+  if (!(disp->d = disp_new((int) n, limit, by_filename)))
+    rb_memerror();
+  disp->d->ractor = disp_ractor();
+  disp->conn = conn;
+
+  ary = rb_ary_new2(n);
+  for (i = 0; i < n; i++) {
+    h = ALLOC(FamDispWorker);
+    h->d = disp->d;
+    h->index = (int) i;
+    disp->d->refs++;
+    rb_ary_push(ary, rb_obj_freeze(TypedData_Wrap_Struct(cDispWorker,
+                                                         &fam_disp_worker_type, h)));
   }
+  disp->workers = rb_obj_freeze(ary);
 
-  return wrap_req(req);
+  return self;
+}
+
+static void *disp_space_nogvl(void *ptr)
+{
+  Dispatch *d = ptr;
+
+  pthread_mutex_lock(&(d->lock));
+  while (d->queued >= d->limit && !d->closed && !d->feeder_interrupted) {
+    d->feeder_waiting = 1;
+    pthread_cond_wait(&(d->space), &(d->lock));
+  }
+  d->feeder_waiting = 0;
+  pthread_mutex_unlock(&(d->lock));
+
+  return NULL;
+}
+
+static void disp_space_ubf(void *ptr)
+{
+  Dispatch *d = ptr;
+
+  pthread_mutex_lock(&(d->lock));
+  d->feeder_interrupted = 1;
+  pthread_cond_signal(&(d->space));
+  pthread_mutex_unlock(&(d->lock));
 }
 
-#ifdef HAVE_FAMMONITORCOLLECTION
 /*
- * Monitor a collection.
- *
- * Raises a Fam::Error exception if the collection could not be
- * monitored.  Note that this method exists under Gamin, but does not
- * actually do anything.
- *
- * Aliases:
- *   Fam::Collection#monitor_col
- *   Fam::Collection#col
- *
- * Examples:
- *   req = fam.monitor_col 'download/images', 1, '*.jpg'
- *
+ * Queue an event, waiting for room first if the queues are full.  The
+ * event is queued even if the wait is interrupted, so it isn't lost;
+ * rb_thread_call_without_gvl2() leaves pending interrupts to us.
  */
-static VALUE fam_conn_col(VALUE self, VALUE col, VALUE depth, VALUE mask)
+static void disp_feed(Dispatch *d, DispEv *de)
 {
-  FAMConnection *conn;
-  FAMRequest *req = NULL;
-  int err;
+  int full;
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  req = ALLOC(FAMRequest);
-  FAMREQUEST_GETREQNUM(req) = (int) req;
-  err = FAMMonitorCollection(conn,
-                             RSTRING(col)->ptr,
-                             req,
-                             NULL,
-                             NUM2INT(depth),
-                             RSTRING(mask)->ptr);
+  pthread_mutex_lock(&(d->lock));
+  full = d->queued >= d->limit && !d->closed;
+  d->feeder_interrupted = 0;
+  pthread_mutex_unlock(&(d->lock));
 
-  if (err == -1) {
-    xfree(req);
-    rb_raise(eError, "Couldn't monitor collection [\"%s\", %d, \"%s\"]: %s",
-             RSTRING(col)->ptr ? RSTRING(col)->ptr : "NULL",
-             NUM2INT(depth),
-             RSTRING(mask)->ptr ? RSTRING(mask)->ptr : "NULL",
-	     fam_error());
+  if (full)
+    rb_thread_call_without_gvl2(disp_space_nogvl, d, disp_space_ubf, d);
+
+  pthread_mutex_lock(&(d->lock));
+  disp_push(d, de);
+  pthread_mutex_unlock(&(d->lock));
+
+  if (full)
+    rb_thread_check_ints();
+}
+
+static VALUE disp_run_ensure(VALUE self)
+{
+  get_disp(self)->running = 0;
+  return Qnil;
+}
+
+static VALUE disp_run_loop(VALUE self)
+{
+  FamDisp *disp = get_disp(self);
+  FamConn *conn;
+  FAMEvent ev;
+  DispEv *de;
+  VALUE request, from;
+
+  while (!disp->d->closed) {
+    conn = get_conn(disp->conn);
+    if (!conn_get_ev(conn, &ev, DISP_POLL))
+      continue;
+    if (!(de = disp_ev_new(&ev, &(conn->meta))))
+      rb_memerror();
+
+    /* nothing else may refer to an acknowledged request; keep it (and
+     * the old one of a MOVED event) on the stack until the event is on
+     * a lane, where fam_disp_mark() finds it, since disp_feed() can
+     * wait for room without the GVL */
+    request = de->request;
+    from = de->meta.from;
+    disp_feed(disp->d, de);
+    RB_GC_GUARD(request);
+    RB_GC_GUARD(from);
   }
 
-  return wrap_req(req);
+  return self;
 }
-#endif /* HAVE_FAMMONITORCOLLECTION */
 
-#ifdef HAVE_FAMSUSPENDMONITOR
 /*
- * Suspend (stop monitoring) a monitor request.
+ * Read events from the connection and queue them for the workers until
+ * the dispatcher is closed (see Fam::Dispatcher#close).  Returns self.
  *
- * Raises a Fam::Error exception if the monitor request could not be
- * suspended.  Note that this method exists under Gamin, but does not
- * actually do anything.
- * 
- * Aliases:
- *   Fam::Connection#suspend
+ * The GVL is released while waiting for events, and while waiting for
+ * the workers to make room when :limit events are queued; the
+ * connection isn't read meanwhile, so the daemon (or the reader
+ * thread, see Fam::Connection.new) applies its own overflow handling.
+ * Closing the dispatcher from another thread stops the loop within a
+ * tenth of a second.
+ *
+ * Raises a Fam::Error exception if the connection fails or is closed,
+ * or if another thread is already running the dispatcher.
  *
  * Examples:
- *   fam.suspend_monitor req
- *   fam.suspend req
+ *   feeder = Thread.new { disp.run }
  *
  */
-static VALUE fam_conn_suspend(VALUE self, VALUE request)
+static VALUE fam_disp_run(VALUE self)
 {
-  FAMConnection *conn;
-  FAMRequest *req;
-  int err;
-
-  Data_Get_Struct(self, FAMConnection, conn);
-  Data_Get_Struct(request, FAMRequest, req);
-  err = FAMSuspendMonitor(conn, req);
+  FamDisp *disp = get_disp(self);
 
-  if (err == -1) {
-    rb_raise(eError, "Couldn't suspend monitor request %d: %s",
-             FAMREQUEST_GETREQNUM(req), fam_error());
-  }
+  if (disp->running)
+    rb_raise(eError, "dispatcher is already running");
+  disp->running = 1;
 
-  return self;
+  return rb_ensure(disp_run_loop, self, disp_run_ensure, self);
 }
-#endif /* HAVE_FAMSUSPENDMONITOR */
 
-#ifdef HAVE_FAMRESUMEMONITOR
 /*
- * Resume (start monitoring) a monitor request.
- *
- * Raises a Fam::Error exception if the monitor request could not be
- * resumed.  Note that this method exists under Gamin, but does not
- * actually do anything.
- * 
- * Aliases:
- *   Fam::Connection#resume
+ * Close a dispatcher: Fam::Dispatcher#run returns, and the workers get
+ * nil from Fam::Dispatcher::Worker#pop once the events already queued
+ * have been handled.  The connection is left open.  Returns self.
  *
  * Examples:
- *   fam.resume_monitor req
- *   fam.resume req
+ *   disp.close
+ *   threads.each(&:join)
  *
  */
-static VALUE fam_conn_resume(VALUE self, VALUE request)
+static VALUE fam_disp_close(VALUE self)
 {
-  FAMConnection *conn;
-  FAMRequest *req;
-  int err;
+  FamDisp *disp = get_disp(self);
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  Data_Get_Struct(request, FAMRequest, req);
-  err = FAMResumeMonitor(conn, req);
-
-  if (err == -1) {
-    rb_raise(eError, "Couldn't resume monitor request %d: %s",
-             FAMREQUEST_GETREQNUM(req), fam_error());
-  }
+  pthread_mutex_lock(&(disp->d->lock));
+  disp_close(disp->d);
+  pthread_mutex_unlock(&(disp->d->lock));
 
   return self;
 }
-#endif /* HAVE_FAMRESUMEMONITOR */
 
 /*
- * Cancel a monitor request.
+ * Returns true if the dispatcher has been closed.
  *
- * Raises a Fam::Error exception if the monitor request could not be
- * cancelled.
- *
- * Note: this method invalidates the specified monitor request.
+ * Examples:
+ *   disp.run until disp.closed?
  *
- * Aliases:
- *   Fam::Connection#cancel
+ */
+static VALUE fam_disp_closed(VALUE self)
+{
+  return get_disp(self)->d->closed ? Qtrue : Qfalse;
+}
+
+/*
+ * Return the dispatcher's workers, a frozen array of
+ * Fam::Dispatcher::Worker objects.  Workers are frozen and shareable,
+ * so they can be passed to Ractor.new.
  *
  * Examples:
- *   fam.cancel_monitor req
- *   fam.cancel req
+ *   ractors = disp.workers.map do |w|
+ *     Ractor.new(w) { |w| w.each { |ev| handle(ev) } }
+ *   end
  *
  */
-static VALUE fam_conn_cancel(VALUE self, VALUE request)
+static VALUE fam_disp_workers(VALUE self)
 {
-  FAMConnection *conn;
-  FAMRequest *req;
-  int err;
-
-  Data_Get_Struct(self, FAMConnection, conn);
-  Data_Get_Struct(request, FAMRequest, req);
-  err = FAMCancelMonitor(conn, req);
-
-  if (err == -1) {
-    rb_raise(eError, "Couldn't cancel monitor request %d: %s",
-             FAMREQUEST_GETREQNUM(req), fam_error());
-  }
-
-  return self;
+  return get_disp(self)->workers;
 }
 
 /*
- * Get the next event from the event queue, or block until an event is
- * available.
+ * Get a hash of counters for this dispatcher.
  *
- * Raises a Fam::Error exception if FAM couldn't check for pending
- * events, or if FAM-Ruby couldn't get the next FAM event.
- * 
- * Aliases:
- *   Fam::Connection#next_ev
- *   Fam::Connection#ev
+ * Keys:
+ *   :queued   events waiting for a worker
+ *   :limit    see Fam::Dispatcher.new
+ *   :events   array of the number of events taken by each worker
+ *   :steals   array of the number of lanes each worker took from
+ *             other workers
  *
  * Examples:
- *   ev = fam.next_event
+ *   p disp.stats[:events]
  *
  */
-static VALUE fam_conn_next_ev(VALUE self)
+static VALUE fam_disp_stats(VALUE self)
 {
-  FAMConnection *conn;
-  FAMEvent *ev = NULL;
-  int err;
+  FamDisp *disp = get_disp(self);
+  Dispatch *d = disp->d;
+  VALUE ret = rb_hash_new(), evs, steals;
+  unsigned long *counts;
+  size_t queued;
+  int i;
+
+  counts = ALLOCA_N(unsigned long, 2 * d->nworkers);
+  pthread_mutex_lock(&(d->lock));
+  queued = d->queued;
+  for (i = 0; i < d->nworkers; i++) {
+    counts[2 * i] = d->workers[i].events;
+    counts[2 * i + 1] = d->workers[i].steals;
+  }
+  pthread_mutex_unlock(&(d->lock));
 
-  Data_Get_Struct(self, FAMConnection, conn);
+  evs = rb_ary_new2(d->nworkers);
+  steals = rb_ary_new2(d->nworkers);
+  for (i = 0; i < d->nworkers; i++) {
+    rb_ary_push(evs, ULONG2NUM(counts[2 * i]));
+    rb_ary_push(steals, ULONG2NUM(counts[2 * i + 1]));
+  }
+
+  rb_hash_aset(ret, ID2SYM(rb_intern("queued")), SIZET2NUM(queued));
+  rb_hash_aset(ret, ID2SYM(rb_intern("limit")), SIZET2NUM(d->limit));
+  rb_hash_aset(ret, ID2SYM(rb_intern("events")), evs);
+  rb_hash_aset(ret, ID2SYM(rb_intern("steals")), steals);
+  return ret;
+}
+
+static FamDispWorker *get_disp_worker(VALUE self)
+{
+  FamDispWorker *h;
+
+  TypedData_Get_Struct(self, FamDispWorker, &fam_disp_worker_type, h);
+  return h;
+}
 
-  if (!(err = FAMPending(conn))) {
-    int fd = FAMCONNECTION_GETFD(conn);
-    fd_set rfds;
+typedef struct {
+  Dispatch *d;
+  int index;
+  double deadline;            /* 0 to wait forever */
+  int found;
+  int closed;
+  /* the taken event; the VALUEs live here, on the worker's stack */
+  DispEv *ev;
+  VALUE request;
+  VALUE from;
+} DispWait;
 
-    FD_ZERO(&rfds);
-    do {
-      if (err == -1)
-        rb_raise(eError, "Couldn't check for pending FAM events: %s", fam_error());
-      FD_SET(fd, &rfds);
-      rb_thread_select(fd + 1, &rfds, NULL, NULL, NULL);
-    } while (!FD_ISSET(fd, &rfds) || !(err = FAMPending(conn)));
+/* take an event with the lock held */
+static void disp_wait_take(DispWait *a)
+{
+  if ((a->ev = disp_take(a->d, a->index))) {
+    a->found = 1;
+    a->request = a->ev->request;
+    a->from = a->ev->meta.from;
   }
+  a->closed = a->d->closed;
+}
 
-  ev = ALLOC(FAMEvent);
-  err = FAMNextEvent(conn, ev);
+static void *disp_pop_nogvl(void *ptr)
+{
+  DispWait *a = ptr;
+  Dispatch *d = a->d;
+  DispWorker *w = &(d->workers[a->index]);
+  struct timespec ts;
+  struct timeval tv;
+  double left, t;
 
-  if (err == -1) {
-    xfree(ev);
-    rb_raise(eError, "Couldn't get next FAM event: %s", fam_error());
+  pthread_mutex_lock(&(d->lock));
+  for (;;) {
+    disp_wait_take(a);
+    if (a->found || a->closed || w->interrupted)
+      break;
+
+    w->waiting = 1;
+    if (a->deadline > 0) {
+      if ((left = a->deadline - fam_now()) <= 0) {
+        w->waiting = 0;
+        break;
+      }
+      gettimeofday(&tv, NULL);
+      t = tv.tv_sec + tv.tv_usec / 1e6 + left;
+      ts.tv_sec = (time_t) t;
+      ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+      pthread_cond_timedwait(&(w->cond), &(d->lock), &ts);
+    } else {
+      pthread_cond_wait(&(w->cond), &(d->lock));
+    }
+    w->waiting = 0;
   }
+  pthread_mutex_unlock(&(d->lock));
+
+  return NULL;
+}
+
+static void disp_pop_ubf(void *ptr)
+{
+  DispWait *a = ptr;
+
+  pthread_mutex_lock(&(a->d->lock));
+  a->d->workers[a->index].interrupted = 1;
+  pthread_cond_signal(&(a->d->workers[a->index].cond));
+  pthread_mutex_unlock(&(a->d->lock));
+}
 
-  return wrap_ev(ev);
+static VALUE disp_check_ints(VALUE unused)
+{
+  rb_thread_check_ints();
+  return Qnil;
 }
 
 /*
- * Are there any events in the queue?
- *
- * Raises a Fam::Error exception if FAM couldn't check for pending
- * events.
- *
- * Aliases:
- *   Fam::Connection#pending
- *
- * Examples:
- *   puts 'no events pending' unless fam.pending?
- *
+ * Wait for the worker's next event; timeout is in seconds, or negative
+ * to wait forever.  Returns a Fam::Event object, or nil.
  */
-static VALUE fam_conn_pending(VALUE self)
+static VALUE disp_pop(FamDispWorker *h, double timeout)
 {
-  FAMConnection *conn;
-  int err;
+  Dispatch *d = h->d;
+  DispWorker *w = &(d->workers[h->index]);
+  DispWait a;
+  VALUE ret;
+  int state = 0;
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  err = FAMPending(conn);
+  memset(&a, 0, sizeof(a));
+  a.d = d;
+  a.index = h->index;
+  a.deadline = (timeout > 0) ? fam_now() + timeout : 0;
 
-  if (err == -1) {
-    rb_raise(eError, "Couldn't check for pending FAM events: %s", fam_error());
+  pthread_mutex_lock(&(d->lock));
+  if (w->popping) {
+    pthread_mutex_unlock(&(d->lock));
+    rb_raise(eError, "worker %d is in use by another thread", h->index);
   }
+  disp_release(d, w);
+  disp_wait_take(&a);
+  w->popping = 1;
+  pthread_mutex_unlock(&(d->lock));
 
-  return (err > 0) ? Qtrue : Qfalse;
+  while (!a.found && !a.closed && timeout) {
+    if (a.deadline > 0 && fam_now() >= a.deadline)
+      break;
+
+    pthread_mutex_lock(&(d->lock));
+    w->interrupted = 0;
+    pthread_mutex_unlock(&(d->lock));
+    rb_thread_call_without_gvl2(disp_pop_nogvl, &a, disp_pop_ubf, &a);
+
+    /* interrupted: run signal handlers, Thread#raise, etc (the *2
+     * variant doesn't, so a taken event can't be lost to them) */
+    if (!a.found && !a.closed)
+      rb_protect(disp_check_ints, Qnil, &state);
+    if (state)
+      break;
+  }
+
+  pthread_mutex_lock(&(d->lock));
+  w->popping = 0;
+  pthread_mutex_unlock(&(d->lock));
+  if (state)
+    rb_jump_tag(state);
+
+  if (!a.found)
+    return Qnil;
+
+  if (disp_ractor() != d->ractor)
+    a.request = a.from = Qnil;
+
+  a.ev->meta.from = a.from;
+  ret = new_ev(a.ev->code, a.ev->reqnum, a.request, a.ev->hostname,
+               a.ev->filename, &(a.ev->meta));
+  disp_ev_free(a.ev);
+  return ret;
 }
 
-#ifdef HAVE_FAMDEBUGLEVEL
 /*
- * Set the debug level of a Fam::Connection object.
+ * Get the worker's next event, waiting at most timeout seconds
+ * (forever if timeout is nil).  Returns a Fam::Event object, or nil on
+ * timeout or once the dispatcher is closed and the queued events have
+ * been handled.
  *
- * Raises a Fam::Error exception on failure.  Note that this method does
- * not exist under Gamin.
+ * Calling pop again tells the dispatcher that the previous event has
+ * been handled; until then, later events in the same lane (for the
+ * same request or file) aren't given to any worker.  A worker should
+ * only be used by one thread at a time.
  *
- * Aliases:
- *   Fam::Connection#debug
+ * The GVL is released while waiting, and the wait is interrupted by
+ * signals and Thread#raise.  In a Ractor other than the connection's,
+ * the event is detached from its request (see Fam::Event#detach), so
+ * Fam::Event#monitor and Fam::Event#context are nil.
+ *
+ * Raises a Fam::Error exception if another thread is using the worker,
+ * or an ArgumentError exception if the timeout is negative.
  *
  * Examples:
- *   fam.debug = Fam::Debug::VERBOSE
+ *   while ev = worker.pop
+ *     handle(ev)
+ *   end
  *
  */
-static VALUE fam_conn_set_debug(VALUE self, VALUE level)
+static VALUE fam_disp_worker_pop(int argc, VALUE *argv, VALUE self)
 {
-  FAMConnection *conn;
-  int err;
-
-  Data_Get_Struct(self, FAMConnection, conn);
-
-  err = FAMDebugLevel(conn, NUM2INT(level));
+  FamDispWorker *h = get_disp_worker(self);
+  VALUE timeout;
 
-  if (err == -1) {
-    rb_raise(eError, "Couldn't set debug level: %s", fam_error());
-  }
-
-  return self;
+  rb_scan_args(argc, argv, "01", &timeout);
+  return disp_pop(h, get_timeout(timeout));
 }
-#endif
 
 /*
- * Get the file descriptor of a Fam::Connection object.
- *
- * Note: This method allows you to wait for FAM events using select()
- * instead of polling via Fam::Connection#pending and
- * Fam::Connection#next_event; see the second example below for more
- * information.
+ * Yield the worker's events until the dispatcher is closed and the
+ * queued events have been handled.  Returns self, or an Enumerator if
+ * no block is given.
  *
  * Aliases:
- *   Fam::Connection#get_descriptor
- *   Fam::Connection#descriptor
- *   Fam::Connection#get_fd
+ *   Fam::Dispatcher::Worker#each_event
  *
  * Examples:
- *   # simple use
- *   fd = fam.fd
+ *   Thread.new { worker.each { |ev| handle(ev) } }
  *
- *   # wrap the FAM connection descriptor in an IO object for use in a
- *   # select() call
- *   io = IO.new fam.fd, 'r'
- *   select [io], , , 10
- *   
  */
-static VALUE fam_conn_fd(VALUE self)
+static VALUE fam_disp_worker_each(VALUE self)
 {
-  FAMConnection *conn;
+  FamDispWorker *h = get_disp_worker(self);
+  VALUE ev;
 
-  Data_Get_Struct(self, FAMConnection, conn);
-  return INT2FIX(FAMCONNECTION_GETFD(conn));
+  RETURN_ENUMERATOR(self, 0, 0);
+  while (!NIL_P(ev = disp_pop(h, -1)))
+    rb_yield(ev);
+
+  return self;
 }
 
-#ifdef HAVE_FAMNOEXISTS
 /*
- * Gamin-specific extension for FAM to not propagate Exists events on
- * directory monitoring startup. This speeds up watching large
- * directories but can introduce a mismatch between the FAM view of the
- * directory and the program own view.
- *
- * Has no effect if FAMNoExists is not available.
+ * Return the worker's index in Fam::Dispatcher#workers.
  *
- * Raises a Fam::Error exception if an error is encountered.
- * 
  * Examples:
- *   fam.no_exists
+ *   puts "worker #{w.index} starting"
  *
  */
-static VALUE fam_conn_no_exists(VALUE self)
+static VALUE fam_disp_worker_index(VALUE self)
 {
-  FAMConnection *conn;
-  int err;
-
-  Data_Get_Struct(self, FAMConnection, conn);
-  err = FAMNoExists(conn);
-
-  if (err == -1) {
-    rb_raise(eError, "Couldn't turn off exists events: %s",
-             fam_error());
-  }
-  return self;
+  return INT2FIX(get_disp_worker(self)->index);
 }
-#endif
+#endif /* USE_READER && HAVE_RB_THREAD_CALL_WITHOUT_GVL */
 
 void Init_fam(void)
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /* no process-wide mutable state; each connection is independent */
+  rb_ext_ractor_safe(1);
+#endif /* HAVE_RB_EXT_RACTOR_SAFE */
+
   mFam = rb_define_module("Fam");
 
-  rb_define_const(mFam, "VERSION", rb_str_new2(VERSION));
+  rb_define_const(mFam, "VERSION", rb_obj_freeze(rb_str_new2(VERSION)));
   eError = rb_define_class_under(mFam, "Error", rb_eStandardError);
 
   /********************************/
@@ -758,7 +7163,7 @@ void Init_fam(void)
   /***************************/
   /* define Connection class */
   /***************************/
-  cConn = rb_define_class_under(mFam, "Connection", rb_cData);
+  cConn = rb_define_class_under(mFam, "Connection", rb_cObject);
   
 #ifdef HAVE_RB_DEFINE_ALLOC_FUNC
   rb_define_alloc_func(cConn, fam_conn_s_alloc);
@@ -770,17 +7175,29 @@ void Init_fam(void)
 
   rb_define_method(cConn, "initialize", fam_conn_init, -1);
   rb_define_method(cConn, "close", fam_conn_close, 0);
+  rb_define_method(cConn, "backend", fam_conn_backend, 0);
   
-  rb_define_method(cConn, "monitor_directory", fam_conn_dir, 1);
+  rb_define_method(cConn, "monitor_directory", fam_conn_dir, -1);
   rb_define_alias(cConn, "monitor_dir", "monitor_directory");
   rb_define_alias(cConn, "directory", "monitor_directory");
   rb_define_alias(cConn, "dir", "monitor_directory");
 
-  rb_define_method(cConn, "monitor_file", fam_conn_file, 1);
+  rb_define_method(cConn, "monitor_file", fam_conn_file, -1);
   rb_define_alias(cConn, "file", "monitor_file");
 
+  rb_define_method(cConn, "monitor_directories", fam_conn_dirs, -1);
+  rb_define_alias(cConn, "monitor_dirs", "monitor_directories");
+  rb_define_alias(cConn, "directories", "monitor_directories");
+  rb_define_alias(cConn, "dirs", "monitor_directories");
+
+  rb_define_method(cConn, "monitor_files", fam_conn_files, -1);
+  rb_define_alias(cConn, "files", "monitor_files");
+
+  rb_define_method(cConn, "monitor_tree", fam_conn_tree, -1);
+  rb_define_alias(cConn, "tree", "monitor_tree");
+
 #ifdef HAVE_FAMMONITORCOLLECTION
-  rb_define_method(cConn, "monitor_collection", fam_conn_col, 2);
+  rb_define_method(cConn, "monitor_collection", fam_conn_col, -1);
   rb_define_alias(cConn, "monitor_col", "monitor_collection");
   rb_define_alias(cConn, "collection", "monitor_collection");
   rb_define_alias(cConn, "col", "monitor_collection");
@@ -799,13 +7216,35 @@ void Init_fam(void)
   rb_define_method(cConn, "cancel_monitor", fam_conn_cancel, 1);
   rb_define_alias(cConn, "cancel", "cancel_monitor");
 
-  rb_define_method(cConn, "next_event", fam_conn_next_ev, 0);
+  rb_define_method(cConn, "next_event", fam_conn_next_ev, -1);
   rb_define_alias(cConn, "next_ev", "next_event");
   rb_define_alias(cConn, "ev", "next_event");
 
+  rb_define_method(cConn, "next_events", fam_conn_next_evs, -1);
+  rb_define_alias(cConn, "next_evs", "next_events");
+
+  rb_define_method(cConn, "drain", fam_conn_drain, -1);
+
+  rb_define_method(cConn, "each_event", fam_conn_each_ev, 0);
+  rb_define_alias(cConn, "each_ev", "each_event");
+
   rb_define_method(cConn, "pending?", fam_conn_pending, 0);
   rb_define_alias(cConn, "pending", "pending?");
 
+  rb_define_method(cConn, "coalesce=", fam_conn_set_coalesce, 1);
+  rb_define_method(cConn, "coalesce", fam_conn_coalesce, 0);
+  rb_define_method(cConn, "coalesced", fam_conn_coalesced, 0);
+  rb_define_method(cConn, "track_moves=", fam_conn_set_track_moves, 1);
+  rb_define_method(cConn, "track_moves", fam_conn_track_moves, 0);
+
+  rb_define_method(cConn, "overflows", fam_conn_overflows, 0);
+  rb_define_method(cConn, "dropped", fam_conn_dropped, 0);
+  rb_define_method(cConn, "queue_depth", fam_conn_queue_depth, 0);
+  rb_define_method(cConn, "stats", fam_conn_stats, 0);
+  rb_define_method(cConn, "record_latency", fam_conn_record_latency, 1);
+  rb_define_method(cConn, "latency", fam_conn_latency, 1);
+  rb_define_method(cConn, "reset_latency", fam_conn_reset_latency, 0);
+
 #ifdef HAVE_FAMDEBUGLEVEL
   rb_define_method(cConn, "debug_level=", fam_conn_set_debug, 1);
   rb_define_alias(cConn, "debug=", "debug_level=");
@@ -823,7 +7262,8 @@ void Init_fam(void)
   /**********************/
   /* define Event class */
   /**********************/
-  cEvent = rb_define_class_under(mFam, "Event", rb_cData);
+  cEvent = rb_define_class_under(mFam, "Event", rb_cObject);
+  rb_undef_alloc_func(cEvent);
 
   rb_define_method(cEvent, "hostname", fam_ev_host, 0);
   rb_define_alias(cEvent, "host", "hostname");
@@ -841,6 +7281,16 @@ void Init_fam(void)
   rb_define_alias(cEvent, "req", "reqnum");
   rb_define_alias(cEvent, "num", "reqnum");
   
+  rb_define_method(cEvent, "monitor", fam_ev_monitor, 0);
+  rb_define_method(cEvent, "context", fam_ev_context, 0);
+  rb_define_method(cEvent, "detach", fam_ev_detach, 0);
+  rb_define_method(cEvent, "old_filename", fam_ev_old_file, 0);
+  rb_define_alias(cEvent, "old_file", "old_filename");
+  rb_define_method(cEvent, "old_monitor", fam_ev_old_monitor, 0);
+  rb_define_method(cEvent, "received_at", fam_ev_received_at, 0);
+  rb_define_method(cEvent, "metadata_only?", fam_ev_metadata_only, 0);
+  rb_define_method(cEvent, "content_changed?", fam_ev_content_changed, 0);
+
   rb_define_method(cEvent, "to_s", fam_ev_to_s, 0);
 
   /* define event codes */
@@ -854,11 +7304,13 @@ void Init_fam(void)
   rb_define_const(cEvent, "ACK", INT2FIX(FAMAcknowledge));
   rb_define_const(cEvent, "EXISTS", INT2FIX(FAMExists));
   rb_define_const(cEvent, "END_EXIST", INT2FIX(FAMEndExist));
+  rb_define_const(cEvent, "OVERFLOW", INT2FIX(FAMOverflow));
   
   /************************/
   /* define Request class */
   /************************/
-  cReq = rb_define_class_under(mFam, "Request", rb_cData);
+  cReq = rb_define_class_under(mFam, "Request", rb_cObject);
+  rb_undef_alloc_func(cReq);
 
   rb_define_method(cReq, "reqnum", fam_req_num, 0);
   rb_define_alias(cReq, "request_number", "reqnum");
@@ -867,4 +7319,58 @@ void Init_fam(void)
   rb_define_alias(cReq, "req_num", "reqnum");
   rb_define_alias(cReq, "req", "reqnum");
   rb_define_alias(cReq, "num", "reqnum");
+
+  rb_define_method(cReq, "context", fam_req_context, 0);
+  rb_define_method(cReq, "snapshot", fam_req_snapshot, 0);
+  rb_define_method(cReq, "latency", fam_req_latency, 1);
+  rb_define_method(cReq, "state", fam_req_state, 0);
+  rb_define_method(cReq, "active?", fam_req_active, 0);
+  rb_define_method(cReq, "cancelled?", fam_req_cancelled, 0);
+
+  /*************************/
+  /* define DirState class */
+  /*************************/
+  cDirState = rb_define_class_under(mFam, "DirState", rb_cObject);
+  rb_undef_alloc_func(cDirState);
+  rb_include_module(cDirState, rb_mEnumerable);
+
+  rb_define_method(cDirState, "include?", ds_include, 1);
+  rb_define_alias(cDirState, "member?", "include?");
+  rb_define_alias(cDirState, "key?", "include?");
+  rb_define_method(cDirState, "info", ds_info, 1);
+  rb_define_method(cDirState, "size", ds_size, 0);
+  rb_define_alias(cDirState, "length", "size");
+  rb_define_method(cDirState, "empty?", ds_empty, 0);
+  rb_define_method(cDirState, "each", ds_each, 0);
+  rb_define_method(cDirState, "generation", ds_generation, 0);
+  rb_define_method(cDirState, "stale?", ds_stale, 0);
+  rb_define_method(cDirState, "rescan", ds_rescan, 0);
+  rb_define_method(cDirState, "path", ds_path, 0);
+
+#ifdef USE_DISPATCHER
+  /***************************/
+  /* define Dispatcher class */
+  /***************************/
+  cDispatcher = rb_define_class_under(mFam, "Dispatcher", rb_cObject);
+  rb_define_alloc_func(cDispatcher, fam_disp_s_alloc);
+
+  rb_define_method(cDispatcher, "initialize", fam_disp_init, -1);
+  rb_define_method(cDispatcher, "run", fam_disp_run, 0);
+  rb_define_method(cDispatcher, "close", fam_disp_close, 0);
+  rb_define_method(cDispatcher, "closed?", fam_disp_closed, 0);
+  rb_define_method(cDispatcher, "workers", fam_disp_workers, 0);
+  rb_define_method(cDispatcher, "stats", fam_disp_stats, 0);
+
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+  disp_ractor_key = rb_ractor_local_storage_value_newkey();
+#endif
+
+  cDispWorker = rb_define_class_under(cDispatcher, "Worker", rb_cObject);
+  rb_undef_alloc_func(cDispWorker);
+
+  rb_define_method(cDispWorker, "pop", fam_disp_worker_pop, -1);
+  rb_define_method(cDispWorker, "each", fam_disp_worker_each, 0);
+  rb_define_alias(cDispWorker, "each_event", "each");
+  rb_define_method(cDispWorker, "index", fam_disp_worker_index, 0);
+#endif /* USE_DISPATCHER */
 }
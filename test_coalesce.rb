@@ -0,0 +1,93 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# test_coalesce.rb - exercise event coalescing                          #
+#                                                                       #
+# With Fam::Connection#coalesce= set, checks that a burst of writes is  #
+# delivered as one CHANGED event, that a file created and deleted       #
+# within the window isn't reported, that other files and monitors keep  #
+# their own events, in order, and that disabling coalescing releases    #
+# held events.  Uses the inotify backend, so needs no daemon.  Exits    #
+# non-zero on failure.                                                  #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+def check(what, ok)
+  abort "FAIL: #{what}" unless ok
+  puts "ok: #{what}"
+end
+
+# read events until timeout seconds pass with none
+def events(fam, timeout = 0.5)
+  ret = []
+  while ev = fam.next_event(timeout)
+    ret << ev
+  end
+  ret
+end
+
+base = File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+dir = Dir.mktmpdir('fam-test', base)
+
+begin
+  %w{a b}.each { |name| File.open(File.join(dir, name), 'w') { |f| f << name } }
+
+  fam = Fam::Connection.new($0, :backend => :inotify)
+  fam.coalesce = 0.2
+  check 'coalescing is on', fam.coalesce == 0.2
+
+  req = fam.monitor_directory dir
+  freq = fam.monitor_file File.join(dir, 'a')
+  events(fam)
+
+  # a burst of writes
+  10.times { File.open(File.join(dir, 'a'), 'a') { |f| f << 'a' } }
+  evs = events(fam)
+  dirs = evs.select { |ev| ev.monitor.equal?(req) }
+  files = evs.select { |ev| ev.monitor.equal?(freq) }
+  check 'a burst is one CHANGED per monitor',
+        dirs.map { |ev| [ev.code, ev.filename] } == [[Fam::Event::CHANGED, 'a']] &&
+        files.map(&:code) == [Fam::Event::CHANGED]
+  check 'folded events are counted', fam.coalesced >= 18
+
+  # bursts to two files stay apart, in order
+  3.times do
+    File.open(File.join(dir, 'b'), 'a') { |f| f << 'b' }
+    File.open(File.join(dir, 'a'), 'a') { |f| f << 'a' }
+  end
+  evs = events(fam).select { |ev| ev.monitor.equal?(req) }
+  check 'each file keeps its own event, in order',
+        evs.map { |ev| [ev.code, ev.filename] } ==
+        [[Fam::Event::CHANGED, 'b'], [Fam::Event::CHANGED, 'a']]
+
+  # created and deleted within the window
+  path = File.join(dir, 'c')
+  File.open(path, 'w') { |f| f << 'c' }
+  File.unlink path
+  evs = events(fam)
+  check 'a short-lived file is not reported', evs.empty?
+
+  # events are held for the window
+  File.open(File.join(dir, 'b'), 'a') { |f| f << 'b' }
+  check 'events are held', fam.next_event(0.05).nil?
+  evs = events(fam)
+  check 'held events are released', evs.map(&:code) == [Fam::Event::CHANGED]
+
+  # turning coalescing off releases what is held
+  File.open(File.join(dir, 'b'), 'a') { |f| f << 'b' }
+  check 'an event is held', fam.next_event(0.05).nil?
+  fam.coalesce = nil
+  ev = fam.next_event(0.05)
+  check 'disabling coalescing releases events',
+        ev && ev.code == Fam::Event::CHANGED && ev.filename == 'b'
+
+  File.open(File.join(dir, 'a'), 'a') { |f| f << 'a' }
+  ev = fam.next_event(0.05)
+  check 'no holding once disabled', ev && ev.code == Fam::Event::CHANGED
+ensure
+  fam.close if fam
+  FileUtils.rm_rf dir
+end
@@ -0,0 +1,114 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# test_dirstate.rb - exercise directory state tracking                  #
+#                                                                       #
+# Checks the :state monitor option: Fam::DirState starts from the       #
+# EXISTS listing or a :snapshot, follows created, deleted and renamed   #
+# entries (a renamed subdirectory included, with move tracking on or    #
+# off), keeps stat information with :state => :stat, and works for      #
+# Fam::Connection#monitor_directories.  Uses the inotify backend, so    #
+# needs no daemon.  Exits non-zero on failure.                          #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+def check(what, ok)
+  abort "FAIL: #{what}" unless ok
+  puts "ok: #{what}"
+end
+
+# read events until timeout seconds pass with none
+def events(fam, timeout = 0.5)
+  ret = []
+  while ev = fam.next_event(timeout)
+    ret << ev
+  end
+  ret
+end
+
+base = File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+dir = Dir.mktmpdir('fam-test', base)
+
+begin
+  Dir.mkdir File.join(dir, 'sub')
+  File.open(File.join(dir, 'sub', 'inner'), 'w') { |f| f << 'inner' }
+  %w{a b}.each { |name| File.open(File.join(dir, name), 'w') { |f| f << name } }
+
+  fam = Fam::Connection.new($0, :backend => :inotify)
+
+  # listing
+  req = fam.monitor_directory dir, :state => :stat
+  state = req.state
+  events(fam)
+  check 'state starts from the listing', state.to_a.sort == %w{a b sub}
+  check 'state has the path', state.path == dir
+  check 'state keeps stat information',
+        state.info('a')[:size] == 1 && state.info('a')[:ino] == File.stat(File.join(dir, 'a')).ino
+
+  # changes
+  gen = state.generation
+  File.open(File.join(dir, 'c'), 'w') { |f| f << 'c' }
+  File.unlink File.join(dir, 'b')
+  events(fam)
+  check 'state follows CREATED and DELETED',
+        state.to_a.sort == %w{a c sub} && state.generation != gen
+  File.open(File.join(dir, 'a'), 'a') { |f| f << 'a' }
+  events(fam)
+  check 'state follows CHANGED', state.info('a')[:size] == 2
+
+  # renamed subdirectory, without and with move tracking
+  File.rename File.join(dir, 'sub'), File.join(dir, 'sub2')
+  events(fam)
+  check 'state follows a renamed subdirectory',
+        state.include?('sub2') && !state.include?('sub') && state.size == 3
+
+  # entries are only known to move tracking once it has seen them
+  fam.track_moves = 0.1
+  File.rename File.join(dir, 'sub2'), File.join(dir, 'sub3')
+  events(fam)
+  File.rename File.join(dir, 'sub3'), File.join(dir, 'sub4')
+  evs = events(fam)
+  check 'the rename is MOVED', evs.map(&:code) == [Fam::Event::MOVED]
+  check 'state follows a MOVED subdirectory',
+        state.include?('sub4') && !state.include?('sub3') && state.size == 3
+  check 'the subdirectory keeps its inode',
+        state.info('sub4')[:ino] == File.stat(File.join(dir, 'sub4')).ino
+  fam.track_moves = nil
+
+  # out of the directory and back
+  File.rename File.join(dir, 'sub4'), File.join(base, File.basename(dir) + '.out')
+  events(fam)
+  check 'state drops an entry moved away', !state.include?('sub4') && state.size == 2
+  File.rename File.join(base, File.basename(dir) + '.out'), File.join(dir, 'sub')
+  events(fam)
+  check 'state adds an entry moved in', state.include?('sub') && state.size == 3
+
+  # snapshots seed the state
+  fam.cancel req
+  events(fam)
+  req = fam.monitor_directory dir, :state => true, :snapshot => true
+  evs = events(fam)
+  check 'no EXISTS with a snapshot', evs.none? { |ev| ev.code == Fam::Event::EXISTS }
+  check 'state starts from the snapshot',
+        req.state.to_a.sort == %w{a c sub} && req.snapshot.sort == %w{a c sub}
+  fam.cancel req
+  events(fam)
+
+  # bulk monitors
+  reqs, errs = fam.monitor_directories [dir, File.join(dir, 'sub')], :state => true
+  events(fam)
+  check 'bulk monitors get their own state',
+        errs.empty? && reqs[0].state.to_a.sort == %w{a c sub} &&
+        reqs[1].state.to_a == %w{inner}
+  File.unlink File.join(dir, 'sub', 'inner')
+  events(fam)
+  check 'bulk state follows events',
+        reqs[1].state.empty? && reqs[0].state.size == 3
+ensure
+  fam.close if fam
+  FileUtils.rm_rf dir
+  FileUtils.rm_rf File.join(base, File.basename(dir) + '.out') if dir
+end
@@ -0,0 +1,100 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# test_dispatcher.rb - exercise Fam::Dispatcher                         #
+#                                                                       #
+# Feeds events from an inotify connection to worker threads through a   #
+# dispatcher with a tiny queue limit, so the feeder keeps waiting for   #
+# room without the GVL while workers run the GC.  Checks that every     #
+# event arrives once, in order per file, with its request, including    #
+# the ACKNOWLEDGE events of requests nothing else refers to.  Needs no  #
+# daemon.  Exits non-zero on failure.                                   #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+def check(what, ok)
+  abort "FAIL: #{what}" unless ok
+  puts "ok: #{what}"
+end
+
+unless defined?(Fam::Dispatcher)
+  puts 'skipped: no Fam::Dispatcher in this build'
+  exit
+end
+
+base = File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+dir = Dir.mktmpdir('fam-test', base)
+FILES = 8
+ROUNDS = 20
+
+begin
+  fam = Fam::Connection.new($0, :backend => :inotify)
+  FileUtils.touch File.join(dir, 'unused')
+  req = fam.monitor_directory dir
+  loop { break if fam.next_event(5).code == Fam::Event::END_EXIST }
+
+  disp = Fam::Dispatcher.new(fam, 2, :partition => :filename, :limit => 2)
+  check 'workers are frozen', disp.workers.all?(&:frozen?)
+
+  seen = Hash.new { |h, k| h[k] = [] }
+  acks = []
+  lock = Mutex.new
+  workers = disp.workers.map do |w|
+    Thread.new do
+      w.each do |ev|
+        # slow handling keeps the lanes full; collect while the feeder
+        # holds the only reference to acknowledged requests
+        GC.start if rand < 0.1
+        sleep 0.001
+        lock.synchronize do
+          if ev.code == Fam::Event::ACKNOWLEDGE
+            acks << ev.monitor
+          elsif ev.monitor.equal?(req)
+            seen[ev.filename] << ev.code
+          end
+        end
+      end
+    end
+  end
+  feeder = Thread.new { disp.run }
+
+  ROUNDS.times do |i|
+    FILES.times do |j|
+      path = File.join(dir, "f#{j}")
+      File.open(path, 'w') { |f| f << i }
+      File.unlink path
+    end
+
+    # requests which are dropped as soon as they're cancelled
+    sub = fam.monitor_file File.join(dir, 'unused')
+    fam.cancel sub
+    sub = nil
+  end
+
+  deadline = Time.now + 10
+  sleep 0.1 until Time.now > deadline ||
+                  (acks.size == ROUNDS && seen.values.map(&:size).sum >= FILES * ROUNDS * 2 &&
+                   disp.stats[:queued] == 0)
+  disp.close
+  feeder.join
+  workers.each(&:join)
+
+  check 'the queue limit is kept', disp.stats[:limit] == 2
+  check 'every file got its events',
+        seen.size == FILES && seen.values.all? { |codes| codes.size >= ROUNDS * 2 }
+  check 'events are in order per file',
+        seen.values.all? { |codes|
+          codes = codes.select { |c| [Fam::Event::CREATED, Fam::Event::DELETED].include?(c) }
+          codes.each_slice(2).all? { |a, b| a == Fam::Event::CREATED && b == Fam::Event::DELETED }
+        }
+  check 'ACKNOWLEDGE events keep their requests',
+        acks.size == ROUNDS && acks.all? { |r| r.is_a?(Fam::Request) && !r.active? }
+  check 'nothing is left queued', disp.stats[:queued] == 0
+  check 'work was spread', disp.stats[:events].all? { |n| n > 0 }
+ensure
+  fam.close if fam
+  FileUtils.rm_rf dir
+end
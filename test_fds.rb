@@ -0,0 +1,47 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# test_fds.rb - wait for events on a descriptor above FD_SETSIZE        #
+#                                                                       #
+# Opens 1100 descriptors before connecting, so the connection's         #
+# descriptor lands above 1024, then waits for events with a timeout.    #
+# Uses the inotify backend, so no daemon is needed.  Exits non-zero on  #
+# failure.                                                              #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+def check(what, ok)
+  abort "FAIL: #{what}" unless ok
+  puts "ok: #{what}"
+end
+
+soft, hard = Process.getrlimit(Process::RLIMIT_NOFILE)
+Process.setrlimit(Process::RLIMIT_NOFILE, [2048, hard].min, hard) if soft < 2048
+
+files = (0...1100).map { File.open('/dev/null') }
+dir = Dir.mktmpdir('fam-test')
+
+begin
+  fam = Fam::Connection.new($0, :backend => :inotify)
+  check 'descriptor above FD_SETSIZE', fam.fd > 1024
+
+  fam.monitor_directory dir
+  loop { break if fam.next_event(5).code == Fam::Event::END_EXIST }
+
+  t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  check 'next_event times out with nil', fam.next_event(0.2).nil?
+  t = Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+  check 'next_event waits for the timeout', t >= 0.15 && t < 2
+
+  File.open(File.join(dir, 'new'), 'w') { |f| f << 'x' }
+  ev = fam.next_event(5)
+  check 'next_event gets the event', ev && ev.code == Fam::Event::CREATED &&
+                                     ev.filename == 'new'
+ensure
+  fam.close if fam
+  files.each(&:close)
+  FileUtils.rm_rf dir
+end
@@ -0,0 +1,105 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# test_filter.rb - exercise per-request event filters                   #
+#                                                                       #
+# Checks the :codes, :include and :exclude monitor options: only        #
+# matching events are delivered, excludes win over includes, leading    #
+# dots have to be matched explicitly, patterns with a slash match whole #
+# paths in a tree, ACKNOWLEDGE and END_EXIST only answer to :codes, and #
+# bad filters raise ArgumentError.  Uses the inotify backend, so needs  #
+# no daemon.  Exits non-zero on failure.                                #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+def check(what, ok)
+  abort "FAIL: #{what}" unless ok
+  puts "ok: #{what}"
+end
+
+# read events until timeout seconds pass with none
+def events(fam, timeout = 0.5)
+  ret = []
+  while ev = fam.next_event(timeout)
+    ret << ev
+  end
+  ret
+end
+
+# [code, filename] pairs, for comparisons
+def pairs(evs)
+  evs.map { |ev| [ev.code, ev.filename] }
+end
+
+def touch(dir, *names)
+  names.each { |name| File.open(File.join(dir, name), 'a') { |f| f << name } }
+end
+
+base = File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+dir = Dir.mktmpdir('fam-test', base)
+C = Fam::Event
+
+begin
+  fam = Fam::Connection.new($0, :backend => :inotify)
+
+  # include and exclude
+  req = fam.monitor_directory dir, :include => '*.rb', :exclude => ['*_spec.rb', '*~']
+  check 'only END_EXIST for an empty directory',
+        pairs(events(fam)) == [[C::END_EXIST, dir]]
+  touch dir, 'a.rb', 'b.txt', 'a_spec.rb', 'a.rb~', '.c.rb'
+  check 'only included, not excluded files',
+        events(fam).map(&:filename).uniq == ['a.rb']
+  fam.cancel req
+  check 'ACKNOWLEDGE gets past patterns',
+        events(fam).map(&:code) == [C::ACKNOWLEDGE]
+
+  # dot files
+  req = fam.monitor_directory dir, :include => ['.*.rb'], :codes => C::CHANGED
+  check 'END_EXIST is subject to :codes', events(fam).empty?
+  touch dir, '.c.rb', 'a.rb'
+  check 'leading dots match explicitly',
+        pairs(events(fam)).uniq == [[C::CHANGED, '.c.rb']]
+  fam.cancel req
+  check 'ACKNOWLEDGE is subject to :codes', events(fam).empty?
+
+  # codes
+  req = fam.monitor_directory dir, :codes => [C::CREATED, C::DELETED]
+  events(fam)
+  touch dir, 'a.rb', 'd.rb'
+  File.unlink File.join(dir, 'b.txt')
+  check 'only the listed codes',
+        pairs(events(fam)) == [[C::CREATED, 'd.rb'], [C::DELETED, 'b.txt']]
+  filtered = fam.stats[:events_filtered]
+  check 'dropped events are counted', filtered > 0
+  fam.cancel req
+  events(fam)
+
+  # slash patterns match paths in a tree
+  FileUtils.mkdir_p File.join(dir, 'lib', 'sub')
+  req = fam.monitor_tree dir, :include => 'lib/*.rb', :codes => C::CHANGED
+  events(fam)
+  touch File.join(dir, 'lib'), 'x.rb'
+  touch File.join(dir, 'lib', 'sub'), 'y.rb'
+  touch dir, 'a.rb'
+  check 'slash patterns match whole paths, one directory at a time',
+        pairs(events(fam)).uniq == [[C::CHANGED, 'lib/x.rb']]
+  fam.cancel req
+  events(fam)
+
+  # bad filters
+  [{ :codes => 99 }, { :codes => 'x' }, { :include => 1 }].each do |opts|
+    err = begin
+      fam.monitor_directory dir, opts
+    rescue ArgumentError, TypeError => e
+      e
+    end
+    check "#{opts.inspect} is rejected", err.is_a?(Exception)
+  end
+  check 'rejected filters add no requests', fam.stats[:live_requests] == 0
+ensure
+  fam.close if fam
+  FileUtils.rm_rf dir
+end
@@ -0,0 +1,122 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# test_inotify.rb - exercise the inotify backend                        #
+#                                                                       #
+# Monitors a scratch directory (on tmpfs when available) and checks the #
+# EXISTS/END_EXIST listing, CREATED, CHANGED and DELETED events, file   #
+# and bulk monitors, cancellation and its ACKNOWLEDGE, and a monitor    #
+# that fails while listing the directory.  Needs no daemon.  Exits      #
+# non-zero on failure.                                                  #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+def check(what, ok)
+  abort "FAIL: #{what}" unless ok
+  puts "ok: #{what}"
+end
+
+# read events until timeout seconds pass with none
+def events(fam, timeout = 0.5)
+  ret = []
+  while ev = fam.next_event(timeout)
+    ret << ev
+  end
+  ret
+end
+
+base = File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+dir = Dir.mktmpdir('fam-test', base)
+
+begin
+  %w{a b}.each { |name| File.open(File.join(dir, name), 'w') { |f| f << name } }
+
+  fam = Fam::Connection.new($0, :backend => :inotify)
+  check 'backend is inotify', fam.backend == :inotify
+
+  # listing
+  req = fam.monitor_directory dir
+  evs = events(fam)
+  check 'EXISTS for the directory and each file',
+        evs[0..-2].map { |ev| [ev.code, ev.filename] }.sort ==
+        [[Fam::Event::EXISTS, dir], [Fam::Event::EXISTS, 'a'],
+         [Fam::Event::EXISTS, 'b']].sort
+  check 'END_EXIST last', evs.last.code == Fam::Event::END_EXIST
+  check 'events carry the request', evs.all? { |ev| ev.monitor.equal?(req) }
+
+  # changes
+  path = File.join(dir, 'c')
+  File.open(path, 'w') { |f| f << 'c' }
+  evs = events(fam)
+  check 'CREATED', evs.any? { |ev| ev.code == Fam::Event::CREATED && ev.filename == 'c' }
+
+  File.open(path, 'a') { |f| f << 'c' }
+  evs = events(fam)
+  check 'CHANGED', evs.any? { |ev| ev.code == Fam::Event::CHANGED && ev.filename == 'c' }
+
+  File.unlink path
+  evs = events(fam)
+  check 'DELETED', evs.any? { |ev| ev.code == Fam::Event::DELETED && ev.filename == 'c' }
+
+  # file monitor
+  freq = fam.monitor_file File.join(dir, 'a')
+  evs = events(fam)
+  check 'file monitor lists the file',
+        evs.map(&:code) == [Fam::Event::EXISTS, Fam::Event::END_EXIST] &&
+        evs.all? { |ev| ev.monitor.equal?(freq) }
+  fam.cancel freq
+  events(fam)
+
+  # bulk monitors want an array
+  err = begin
+    fam.monitor_files File.join(dir, 'a')
+  rescue TypeError => e
+    e
+  end
+  check 'monitor_files rejects a string', err.is_a?(TypeError)
+
+  # cancellation
+  fam.cancel req
+  evs = events(fam)
+  check 'ACKNOWLEDGE after cancel',
+        evs.map(&:code) == [Fam::Event::ACKNOWLEDGE] && evs[0].monitor.equal?(req)
+  check 'request is inactive', !req.active? && req.cancelled?
+
+  File.open(File.join(dir, 'd'), 'w') { |f| f << 'd' }
+  check 'no events after cancel', events(fam).empty?
+
+  # a monitor whose listing fails (opendir() runs out of descriptors)
+  # must leave nothing behind that refers to its request
+  soft, hard = Process.getrlimit(Process::RLIMIT_NOFILE)
+  files = []
+  begin
+    Process.setrlimit(Process::RLIMIT_NOFILE, 256, hard)
+    begin
+      loop { files << File.open('/dev/null') }
+    rescue Errno::EMFILE
+    end
+    failed = begin
+      fam.monitor_directory dir
+      false
+    rescue Fam::Error
+      true
+    end
+  ensure
+    files.each(&:close)
+    Process.setrlimit(Process::RLIMIT_NOFILE, soft, hard)
+  end
+  check 'monitor fails when the listing fails', failed
+  GC.start
+  File.open(File.join(dir, 'e'), 'w') { |f| f << 'e' }
+  check 'no events from the failed monitor', events(fam).empty?
+
+  req = fam.monitor_directory dir
+  evs = events(fam)
+  check 'monitoring works afterwards', evs.last.code == Fam::Event::END_EXIST
+ensure
+  fam.close if fam
+  FileUtils.rm_rf dir
+end
@@ -0,0 +1,92 @@
+#!/usr/bin/env ruby
+
+#########################################################################
+# test_moves.rb - exercise move tracking                                #
+#                                                                       #
+# With Fam::Connection#track_moves= set, checks that a rename within a  #
+# monitored directory arrives as one MOVED event with both names, that  #
+# a rename between two monitored directories names the old monitor,     #
+# and that a rename out of everything monitored is still a DELETED      #
+# event.  Uses the inotify backend, so needs no daemon.  Exits non-zero #
+# on failure.                                                           #
+#########################################################################
+
+require 'fam'
+require 'tmpdir'
+require 'fileutils'
+
+def check(what, ok)
+  abort "FAIL: #{what}" unless ok
+  puts "ok: #{what}"
+end
+
+# read events until timeout seconds pass with none
+def events(fam, timeout = 0.5)
+  ret = []
+  while ev = fam.next_event(timeout)
+    ret << ev
+  end
+  ret
+end
+
+base = File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+dir = Dir.mktmpdir('fam-test', base)
+
+begin
+  %w{src dst outside}.each { |name| Dir.mkdir File.join(dir, name) }
+  src, dst, outside = %w{src dst outside}.map { |name| File.join(dir, name) }
+  File.open(File.join(src, 'a'), 'w') { |f| f << 'a' }
+  File.open(File.join(src, 'b'), 'w') { |f| f << 'b' }
+
+  fam = Fam::Connection.new($0, :backend => :inotify)
+  fam.track_moves = 0.1
+  check 'tracking is on', fam.track_moves == 0.1
+
+  sreq = fam.monitor_directory src
+  dreq = fam.monitor_directory dst
+  events(fam)
+
+  # rename within a directory
+  File.rename File.join(src, 'a'), File.join(src, 'a2')
+  evs = events(fam)
+  check 'one event for a rename', evs.size == 1
+  ev = evs.first
+  check 'rename is MOVED', ev.code == Fam::Event::MOVED
+  check 'MOVED has both names', ev.filename == 'a2' && ev.old_filename == 'a'
+  check 'MOVED carries the request',
+        ev.monitor.equal?(sreq) && ev.old_monitor.equal?(sreq)
+
+  # rename between monitored directories
+  File.rename File.join(src, 'a2'), File.join(dst, 'a3')
+  evs = events(fam)
+  check 'rename across monitors is MOVED',
+        evs.size == 1 && evs.first.code == Fam::Event::MOVED
+  ev = evs.first
+  check 'MOVED across monitors names both',
+        ev.filename == 'a3' && ev.monitor.equal?(dreq) &&
+        ev.old_filename == 'a2' && ev.old_monitor.equal?(sreq)
+
+  # rename out of everything monitored
+  File.rename File.join(src, 'b'), File.join(outside, 'b')
+  evs = events(fam)
+  check 'rename out of the tree is DELETED',
+        evs.map { |e| [e.code, e.filename] } == [[Fam::Event::DELETED, 'b']]
+  check 'DELETED has no old name', evs.first.old_filename.nil?
+
+  # and back in, from somewhere nothing was known about
+  File.rename File.join(outside, 'b'), File.join(dst, 'b')
+  evs = events(fam)
+  check 'rename into the tree is CREATED',
+        evs.map { |e| [e.code, e.filename] } == [[Fam::Event::CREATED, 'b']]
+
+  check 'moves are counted', fam.stats[:moves] == 2
+
+  fam.track_moves = nil
+  File.rename File.join(dst, 'b'), File.join(dst, 'b2')
+  evs = events(fam)
+  check 'no MOVED without tracking',
+        evs.map(&:code).sort == [Fam::Event::CREATED, Fam::Event::DELETED].sort
+ensure
+  fam.close if fam
+  FileUtils.rm_rf dir
+end